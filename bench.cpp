@@ -0,0 +1,562 @@
+#include "ecs.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Benchmark suite: `make bench`, or run ecs_bench directly.
+//
+//   ecs_bench [--reps N] [--warmup N] [--entities N] [--filter TEXT]
+//             [--format text|json|csv]
+//
+// Every scenario runs its warmup repetitions, then the measured ones; each
+// repetition times only its own hot loop (setup is excluded) and reports
+// nanoseconds per operation. Results are summarised as mean, min, max and
+// nearest-rank percentiles over the repetitions. Worlds shared by all
+// repetitions of a scenario are built only if it passes --filter.
+
+using namespace mm::ecs;
+using namespace std::chrono;
+
+template <size_t I> struct comp {
+  float v[4];
+};
+
+using world = ecs<comp<0>, comp<1>, comp<2>, comp<3>, comp<4>, comp<5>,
+                  comp<6>, comp<7>>;
+
+struct options {
+  size_t reps = 10;
+  size_t warmup = 2;
+  size_t entities = 100'000;
+  std::string filter = {};
+  std::string format = "text";
+};
+
+// One repetition: prepares its own state and returns the nanoseconds spent
+// in the measured part.
+using repetition = std::function<double()>;
+
+// Builds the state the repetitions share and returns the repetition.
+using setup = std::function<repetition()>;
+
+struct scenario {
+  std::string name;
+  size_t ops;
+  setup prepare;
+};
+
+// For scenarios whose repetitions build everything themselves.
+inline setup stateless(repetition rep) {
+  return [rep = std::move(rep)] { return rep; };
+}
+
+struct summary {
+  std::string name;
+  size_t ops;
+  double mean, min, p50, p90, p99, max;
+};
+
+struct stopwatch {
+  steady_clock::time_point start = steady_clock::now();
+  inline double ns() const {
+    return duration<double, std::nano>(steady_clock::now() - start).count();
+  }
+};
+
+inline double percentile(const std::vector<double> &sorted, double p) {
+  const size_t rank = static_cast<size_t>(
+      std::ceil(p / 100.0 * static_cast<double>(sorted.size())));
+  return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+inline summary run(const scenario &s, const options &opt) {
+  const repetition rep = s.prepare();
+  for (size_t i = 0; i < opt.warmup; i++) {
+    rep();
+  }
+  std::vector<double> samples;
+  for (size_t i = 0; i < opt.reps; i++) {
+    samples.push_back(rep() / static_cast<double>(s.ops));
+  }
+  std::ranges::sort(samples);
+  const double mean = std::accumulate(samples.begin(), samples.end(), 0.0) /
+                      static_cast<double>(samples.size());
+  return {s.name,
+          s.ops,
+          mean,
+          samples.front(),
+          percentile(samples, 50),
+          percentile(samples, 90),
+          percentile(samples, 99),
+          samples.back()};
+}
+
+volatile float sink = 0.0f;
+
+// ---------------- ENTITIES ----------------
+void entity_scenarios(std::vector<scenario> &out, const options &opt) {
+  const size_t n = opt.entities;
+  // remove_entity looks the id up linearly, so it runs on fewer entities.
+  const size_t small = std::min<size_t>(n, 10'000);
+
+  out.push_back({"entity/create", n, stateless([n] {
+                   world w;
+                   stopwatch t;
+                   for (size_t i = 0; i < n; i++) {
+                     [[maybe_unused]] entity e = w.add_entity();
+                   }
+                   return t.ns();
+                 })});
+  out.push_back({"entity/destroy-batch", n, stateless([n] {
+                   world w;
+                   std::vector<entity> es(n);
+                   for (entity &e : es) {
+                     e = w.add_entity();
+                     w.add_component<comp<0>>(e);
+                   }
+                   stopwatch t;
+                   w.remove_entities(std::span<const entity>(es));
+                   return t.ns();
+                 })});
+  out.push_back({"entity/destroy-single", small, stateless([small] {
+                   world w;
+                   std::vector<entity> es(small);
+                   for (entity &e : es) {
+                     e = w.add_entity();
+                     w.add_component<comp<0>>(e);
+                   }
+                   stopwatch t;
+                   for (entity e : es) {
+                     w.remove_entity(e);
+                   }
+                   return t.ns();
+                 })});
+}
+
+// ---------------- COMPONENTS ----------------
+// Checked calls look the entity up linearly, so both policies run on the
+// same, smaller world to stay comparable. Gets hand out smart_refs under
+// both policies, as checked raw references cannot be held in std::expected;
+// ref/raw-get measures the raw path.
+template <safety_policy P>
+void component_scenarios(std::vector<scenario> &out, const options &opt,
+                         std::string_view policy) {
+  const size_t n = std::min<size_t>(opt.entities, 10'000);
+  auto populate = [n](world &w, bool with_component) {
+    std::vector<entity> es(n);
+    for (entity &e : es) {
+      e = w.add_entity();
+      if (with_component) {
+        w.add_component<comp<0>>(e);
+      }
+    }
+    return es;
+  };
+  auto name = [policy](std::string_view op) {
+    return std::format("component/{}/{}", op, policy);
+  };
+
+  out.push_back({name("add"), n, stateless([=] {
+                   world w;
+                   auto es = populate(w, false);
+                   stopwatch t;
+                   for (entity e : es) {
+                     static_cast<void>(w.add_component<comp<0>, P>(e));
+                   }
+                   return t.ns();
+                 })});
+  out.push_back({name("remove"), n, stateless([=] {
+                   world w;
+                   auto es = populate(w, true);
+                   stopwatch t;
+                   for (entity e : es) {
+                     static_cast<void>(w.remove_component<comp<0>, P>(e));
+                   }
+                   return t.ns();
+                 })});
+  out.push_back({name("get"), n, stateless([=] {
+                   world w;
+                   auto es = populate(w, true);
+                   float sum = 0.0f;
+                   stopwatch t;
+                   for (entity e : es) {
+                     if constexpr (P == safety_policy::checked) {
+                       sum += (*w.get_component<comp<0>,
+                                                reference_style::stable, P>(
+                                  e))
+                                  ->v[0];
+                     } else {
+                       sum += w.get_component<comp<0>,
+                                              reference_style::stable, P>(e)
+                                  ->v[0];
+                     }
+                   }
+                   const double ns = t.ns();
+                   sink = sum;
+                   return ns;
+                 })});
+}
+
+// ---------------- VIEWS ----------------
+// A K-component view at selectivity s: every pool holds n entities, of
+// which a fraction s are shared by all K pools and the rest belong to that
+// pool alone, so the view visits n entities and yields s * n of them.
+template <size_t... I>
+void view_scenario(std::vector<scenario> &out, const options &opt, double s,
+                   std::index_sequence<I...>) {
+  constexpr size_t k = sizeof...(I);
+  const size_t n = opt.entities;
+  auto prepare = [n, s]() -> repetition {
+    auto w = std::make_shared<world>();
+    const size_t shared = static_cast<size_t>(static_cast<double>(n) * s);
+    for (size_t i = 0; i < shared; i++) {
+      entity e = w->add_entity();
+      (w->add_component<comp<I>>(e), ...);
+    }
+    auto own = [&]<size_t J>() {
+      for (size_t i = shared; i < n; i++) {
+        w->add_component<comp<J>>(w->add_entity());
+      }
+    };
+    (own.template operator()<I>(), ...);
+
+    return [w] {
+      float sum = 0.0f;
+      stopwatch t;
+      for (auto [e, v] : view<comp<I>...>(*w)) {
+        std::apply([&](auto &...c) { ((sum += c.v[0]), ...); }, v);
+      }
+      const double ns = t.ns();
+      sink = sum;
+      return ns;
+    };
+  };
+  out.push_back({std::format("view/{}/{}%", k, static_cast<int>(s * 100)), n,
+                 prepare});
+}
+
+void view_scenarios(std::vector<scenario> &out, const options &opt) {
+  view_scenario(out, opt, 1.0, std::make_index_sequence<1>{});
+  for (double s : {1.0, 0.5, 0.1}) {
+    view_scenario(out, opt, s, std::make_index_sequence<2>{});
+    view_scenario(out, opt, s, std::make_index_sequence<4>{});
+    view_scenario(out, opt, s, std::make_index_sequence<8>{});
+  }
+}
+
+// ---------------- CHURN ----------------
+// Removing and re-adding components in random order permutes the dense
+// arrays relative to entity ids; views over churned pools then jump around
+// memory instead of streaming through it.
+struct churn_world {
+  world w;
+  std::vector<entity> order;
+  std::mt19937 rng{1234};
+
+  inline explicit churn_world(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      order.push_back(w.add_entity());
+      w.add_component<comp<0>>(order.back());
+      w.add_component<comp<1>>(order.back());
+    }
+  }
+
+  // One remove/add pass over each pool, in a fresh random order each.
+  inline void churn() {
+    std::shuffle(order.begin(), order.end(), rng);
+    for (entity e : order) {
+      w.remove_component<comp<0>>(e);
+      w.add_component<comp<0>>(e);
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+    for (entity e : order) {
+      w.remove_component<comp<1>>(e);
+      w.add_component<comp<1>>(e);
+    }
+  }
+};
+
+void churn_scenarios(std::vector<scenario> &out, const options &opt) {
+  const size_t n = opt.entities;
+  out.push_back({"churn/remove-add", 2 * n, [n]() -> repetition {
+                   auto c = std::make_shared<churn_world>(n);
+                   return [c] {
+                     stopwatch t;
+                     c->churn();
+                     return t.ns();
+                   };
+                 }});
+
+  auto iterate = [](std::shared_ptr<churn_world> c) -> repetition {
+    return [c] {
+      float sum = 0.0f;
+      stopwatch t;
+      for (auto [e, v] : view<comp<0>, comp<1>>(c->w)) {
+        auto &[a, b] = v;
+        sum += a.v[0] + b.v[0];
+      }
+      const double ns = t.ns();
+      sink = sum;
+      return ns;
+    };
+  };
+  out.push_back({"churn/view-fresh", n, [n, iterate] {
+                   return iterate(std::make_shared<churn_world>(n));
+                 }});
+  out.push_back({"churn/view-churned", n, [n, iterate] {
+                   auto c = std::make_shared<churn_world>(n);
+                   c->churn();
+                   return iterate(c);
+                 }});
+}
+
+// ---------------- SMART REFS ----------------
+struct ref_world {
+  world w;
+  std::vector<entity> es;
+  // Declared after w, so the references are dropped first.
+  std::vector<smart_ref<comp<0>>> refs = {};
+
+  inline explicit ref_world(size_t n) : es(n) {
+    for (entity &e : es) {
+      e = w.add_entity();
+      w.add_component<comp<0>>(e);
+    }
+  }
+};
+
+void smart_ref_scenarios(std::vector<scenario> &out, const options &opt) {
+  const size_t n = opt.entities;
+
+  out.push_back({"ref/raw-get", n, [n]() -> repetition {
+                   auto r = std::make_shared<ref_world>(n);
+                   return [r] {
+                     float sum = 0.0f;
+                     stopwatch t;
+                     for (entity e : r->es) {
+                       sum += r->w.get_component<comp<0>>(e).v[0];
+                     }
+                     const double ns = t.ns();
+                     sink = sum;
+                     return ns;
+                   };
+                 }});
+  out.push_back({"ref/smart-create-drop", n, [n]() -> repetition {
+                   auto r = std::make_shared<ref_world>(n);
+                   return [r] {
+                     float sum = 0.0f;
+                     stopwatch t;
+                     for (entity e : r->es) {
+                       smart_ref<comp<0>> ref =
+                           r->w.get_component<comp<0>,
+                                              reference_style::stable>(e);
+                       sum += ref->v[0];
+                     }
+                     const double ns = t.ns();
+                     sink = sum;
+                     return ns;
+                   };
+                 }});
+  out.push_back({"ref/pointer-access", n, [n]() -> repetition {
+                   auto r = std::make_shared<ref_world>(n);
+                   std::vector<comp<0> *> pointers;
+                   for (entity e : r->es) {
+                     pointers.push_back(&r->w.get_component<comp<0>>(e));
+                   }
+                   return [r, pointers] {
+                     float sum = 0.0f;
+                     stopwatch t;
+                     for (comp<0> *p : pointers) {
+                       sum += p->v[0];
+                     }
+                     const double ns = t.ns();
+                     sink = sum;
+                     return ns;
+                   };
+                 }});
+  out.push_back({"ref/smart-access", n, [n]() -> repetition {
+                   auto r = std::make_shared<ref_world>(n);
+                   for (entity e : r->es) {
+                     r->refs.push_back(
+                         r->w.get_component<comp<0>, reference_style::stable>(
+                             e));
+                   }
+                   return [r] {
+                     float sum = 0.0f;
+                     stopwatch t;
+                     for (auto &ref : r->refs) {
+                       sum += ref->v[0];
+                     }
+                     const double ns = t.ns();
+                     sink = sum;
+                     return ns;
+                   };
+                 }});
+}
+
+// ---------------- FORKS ----------------
+struct shared_comp {
+  float v[4];
+};
+
+template <>
+struct mm::ecs::component_traits<shared_comp>
+    : mm::ecs::default_component_traits {
+  constexpr static pool_storage storage = pool_storage::copy_on_write;
+};
+
+// Copy-on-write pools share whole arrays, so the first write to a fork pays
+// for copying the array it lands in: a value write copies data, an addition
+// copies every array of the pool.
+void fork_scenarios(std::vector<scenario> &out, const options &opt) {
+  using shared_world = ecs<shared_comp>;
+  const size_t n = opt.entities;
+  auto populate = [n] {
+    auto w = std::make_shared<shared_world>();
+    for (size_t i = 0; i < n; i++) {
+      w->add_component<shared_comp>(w->add_entity());
+    }
+    return w;
+  };
+
+  out.push_back({"fork/fork", 1, [populate]() -> repetition {
+                   auto w = populate();
+                   return [w] {
+                     stopwatch t;
+                     shared_world child = w->fork();
+                     return t.ns();
+                   };
+                 }});
+  out.push_back({"fork/fork-write", 1, [populate]() -> repetition {
+                   auto w = populate();
+                   return [w] {
+                     stopwatch t;
+                     shared_world child = w->fork();
+                     child.get_component<shared_comp>(0).v[0] += 1.0f;
+                     return t.ns();
+                   };
+                 }});
+  out.push_back({"fork/fork-add", 1, [populate]() -> repetition {
+                   auto w = populate();
+                   return [w] {
+                     stopwatch t;
+                     shared_world child = w->fork();
+                     child.add_component<shared_comp>(child.add_entity());
+                     return t.ns();
+                   };
+                 }});
+}
+
+// ---------------- OUTPUT ----------------
+void print_text(const std::vector<summary> &results, const options &opt) {
+  std::println("{} repetitions after {} warmup, ns/op", opt.reps, opt.warmup);
+  std::println("{:<28} {:>9} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}",
+               "scenario", "ops", "mean", "min", "p50", "p90", "p99", "max");
+  for (const summary &r : results) {
+    std::println("{:<28} {:>9} {:>10.2f} {:>10.2f} {:>10.2f} {:>10.2f} "
+                 "{:>10.2f} {:>10.2f}",
+                 r.name, r.ops, r.mean, r.min, r.p50, r.p90, r.p99, r.max);
+  }
+}
+
+void print_csv(const std::vector<summary> &results) {
+  std::println("scenario,ops,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,max_ns");
+  for (const summary &r : results) {
+    std::println("{},{},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f},{:.3f}", r.name,
+                 r.ops, r.mean, r.min, r.p50, r.p90, r.p99, r.max);
+  }
+}
+
+void print_json(const std::vector<summary> &results, const options &opt) {
+  std::println("{{");
+  std::println("  \"reps\": {},", opt.reps);
+  std::println("  \"warmup\": {},", opt.warmup);
+  std::println("  \"entities\": {},", opt.entities);
+  std::println("  \"unit\": \"ns/op\",");
+  std::println("  \"results\": [");
+  for (size_t i = 0; i < results.size(); i++) {
+    const summary &r = results[i];
+    std::println("    {{\"scenario\": \"{}\", \"ops\": {}, \"mean\": {:.3f}, "
+                 "\"min\": {:.3f}, \"p50\": {:.3f}, \"p90\": {:.3f}, "
+                 "\"p99\": {:.3f}, \"max\": {:.3f}}}{}",
+                 r.name, r.ops, r.mean, r.min, r.p50, r.p90, r.p99, r.max,
+                 i + 1 < results.size() ? "," : "");
+  }
+  std::println("  ]");
+  std::println("}}");
+}
+
+options parse(int argc, char **argv) {
+  options opt;
+  auto usage = [&] {
+    std::println(stderr,
+                 "usage: {} [--reps N] [--warmup N] [--entities N] "
+                 "[--filter TEXT] [--format text|json|csv]",
+                 argv[0]);
+    std::exit(2);
+  };
+  for (int i = 1; i < argc; i++) {
+    const std::string_view arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+    }
+    const char *value = argv[++i];
+    if (arg == "--reps") {
+      opt.reps = std::strtoul(value, nullptr, 10);
+    } else if (arg == "--warmup") {
+      opt.warmup = std::strtoul(value, nullptr, 10);
+    } else if (arg == "--entities") {
+      opt.entities = std::strtoul(value, nullptr, 10);
+    } else if (arg == "--filter") {
+      opt.filter = value;
+    } else if (arg == "--format") {
+      opt.format = value;
+    } else {
+      usage();
+    }
+  }
+  if (opt.reps == 0 || opt.entities == 0 ||
+      (opt.format != "text" && opt.format != "json" && opt.format != "csv")) {
+    usage();
+  }
+  return opt;
+}
+
+int main(int argc, char **argv) {
+  const options opt = parse(argc, argv);
+
+  std::vector<scenario> scenarios;
+  entity_scenarios(scenarios, opt);
+  component_scenarios<safety_policy::unchecked>(scenarios, opt, "unchecked");
+  component_scenarios<safety_policy::checked>(scenarios, opt, "checked");
+  view_scenarios(scenarios, opt);
+  churn_scenarios(scenarios, opt);
+  smart_ref_scenarios(scenarios, opt);
+  fork_scenarios(scenarios, opt);
+
+  std::vector<summary> results;
+  for (const scenario &s : scenarios) {
+    if (s.name.find(opt.filter) != std::string::npos) {
+      results.push_back(run(s, opt));
+    }
+  }
+
+  if (opt.format == "json") {
+    print_json(results, opt);
+  } else if (opt.format == "csv") {
+    print_csv(results);
+  } else {
+    print_text(results, opt);
+  }
+}
@@ -1,495 +1,5494 @@
 #pragma once
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <coroutine>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <expected>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <latch>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <queue>
+#include <ranges>
+#include <source_location>
+#include <span>
+#include <spanstream>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#define MM_ECS_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define MM_ECS_HAS_MMAP 0
+#endif
+
 namespace mm {
 namespace ecs {
 enum class error {
   component_already_exists,
   component_does_not_exist,
   component_has_references,
-  no_such_entity
+  no_such_entity,
+  snapshot_io_failed,
+  snapshot_incompatible,
+  mapping_failed,
+  stream_io_failed
 };
 enum class remove_policy { strict, lax };
 enum class safety_policy { checked, unchecked };
 enum class reference_style { raw, stable };
+enum class pool_storage { heap, mapped, copy_on_write };
+enum class refcount_policy { plain, atomic };
 
 using entity = uint32_t;
 constexpr entity invalid_entity = std::numeric_limits<entity>::max();
 
-namespace _private {
-using component_id = uint32_t;
+// How many elements ahead of the cursor a multi-component view prefetches.
+// Can be overridden per view through its constructor; 0 disables it.
+#ifndef MM_ECS_PREFETCH_DISTANCE
+#define MM_ECS_PREFETCH_DISTANCE 8
+#endif
+constexpr size_t default_prefetch_distance = MM_ECS_PREFETCH_DISTANCE;
 
-constexpr size_t invalid_component_index = std::numeric_limits<size_t>::max();
-template <typename C> struct component_pool {
-  std::vector<C> data = {};
-  std::vector<entity> back = {};
-  std::vector<size_t> forward = {};
+// Per-component configuration. Specialise component_traits for a component
+// type, deriving from default_component_traits and overriding what differs:
+//
+//   template <> struct mm::ecs::component_traits<v3>
+//       : mm::ecs::default_component_traits {
+//     constexpr static refcount_policy refcount = refcount_policy::atomic;
+//   };
+struct default_component_traits {
+  // atomic lets smart_refs to the component be created and dropped from
+  // several threads at once; plain is cheaper when only one thread does.
+  constexpr static refcount_policy refcount = refcount_policy::plain;
+  // Keeps a second copy of the pool's data holding the previous frame, which
+  // other threads may read while this one writes; see ecs::swap_buffers.
+  constexpr static bool double_buffered = false;
+  // mapped keeps the pool's arrays in memory mappings that can be backed by
+  // files, see ecs::map_pool. Needs a trivially copyable component and rules
+  // out double buffering. copy_on_write shares the arrays with forks of the
+  // world until either side writes to them, see ecs::fork.
+  constexpr static pool_storage storage = pool_storage::heap;
+};
+template <typename C> struct component_traits : default_component_traits {};
 
-  std::vector<uint32_t> refcounts = {};
+// Sizes and counters of one component pool, see ecs::stats. Bytes count the
+// reserved capacity of each array; copy-on-write pools may share theirs with
+// forks, and mapped pools count their mapped elements.
+struct pool_stats {
+  size_t size = 0;
+  size_t data_capacity = 0;
+  size_t back_capacity = 0;
+  size_t forward_size = 0;
+  size_t forward_capacity = 0;
+  size_t data_bytes = 0;
+  size_t back_bytes = 0;
+  size_t forward_bytes = 0;
+  size_t refcount_bytes = 0;
+  // Double buffer and change log.
+  size_t extra_bytes = 0;
+  // Fraction of forward that points at a component; low after the
+  // highest-numbered entities lost theirs.
+  double forward_density = 0;
+  // Additions and removals since the last ecs::reset_stats, including bulk
+  // paths: staged merges, snapshot loads and deltas, column imports, rewinds
+  // and adopted mapped pools count every component they add or drop.
+  uint64_t added = 0;
+  uint64_t removed = 0;
+  // Live smart_refs into the pool, kept as a running count.
+  uint64_t refs = 0;
 
-  template <typename... Args>
-  inline std::expected<void, error> add_element(entity e, Args &&...args) {
-    if (e >= forward.size()) {
-      forward.resize(e + 1, invalid_component_index);
-    } else if (forward[e] != invalid_component_index) {
-      return std::unexpected(error::component_already_exists);
-    }
+  inline size_t bytes() const {
+    return data_bytes + back_bytes + forward_bytes + refcount_bytes +
+           extra_bytes;
+  }
+};
 
-    add_element_fast(e, std::forward<Args>(args)...);
+// Live smart_refs on a pool, the most held on one component, and how many
+// components they pin (which cannot be removed); see ecs::scan_refs.
+struct ref_stats {
+  uint64_t total_refs = 0;
+  uint32_t max_refs = 0;
+  size_t pinned = 0;
+};
 
-    return {};
-  }
+template <size_t N> struct world_stats {
+  size_t entities = 0;
+  size_t entity_bytes = 0;
+  entity next_entity = 0;
+  // In the order of the world's component types.
+  std::array<pool_stats, N> pools = {};
 
-  template <typename... Args>
-  inline void add_element_fast(entity e, Args &&...args) {
-    static_assert(std::is_constructible_v<C, Args &&...>,
-                  "add_element_fast(): arguments do not match any constructor "
-                  "of this component type");
-    if (e >= forward.size()) {
-      forward.resize(e + 1, invalid_component_index);
+  inline size_t bytes() const {
+    size_t total = entity_bytes;
+    for (const pool_stats &p : pools) {
+      total += p.bytes();
     }
+    return total;
+  }
+};
 
-    forward[e] = back.size();
-    back.push_back(e);
+// Snapshots write trivially copyable components as raw blocks. Anything else
+// needs a serializer specialisation (which also overrides the raw path):
+//
+//   template <> struct mm::ecs::serializer<name> {
+//     static void save(std::ostream &os, const name &n);
+//     static name load(std::istream &is);
+//   };
+template <typename C> struct serializer;
 
-    if constexpr (sizeof...(Args) == 0) {
-      data.emplace_back();
-    } else {
-      data.emplace_back(std::forward<Args>(args)...);
-    }
+template <typename C>
+concept has_serializer =
+    requires(std::ostream &os, std::istream &is, const C &c) {
+      serializer<C>::save(os, c);
+      { serializer<C>::load(is) } -> std::convertible_to<C>;
+    };
 
-    refcounts.push_back(0);
-  }
+template <typename C>
+concept snapshottable = std::is_trivially_copyable_v<C> || has_serializer<C>;
 
-  inline std::expected<void, error> remove_element(entity e) {
-    if (forward.size() == 0 || back.size() == 0) {
-      return std::unexpected(error::component_does_not_exist);
-    }
-    if (forward[e] == invalid_component_index) {
-      return std::unexpected(error::component_does_not_exist);
-    }
-    if (refcounts[forward[e]] != 0) {
-      return std::unexpected(error::component_has_references);
-    }
+constexpr uint32_t snapshot_magic = 0x53454d4d; // "MMES"
+constexpr uint32_t snapshot_version = 2;
+constexpr uint32_t delta_magic = 0x44454d4d; // "MMED"
+constexpr uint32_t delta_version = 1;
+constexpr uint32_t columns_magic = 0x4c454d4d; // "MMEL"
+constexpr uint32_t columns_version = 1;
 
-    remove_element_fast(e);
+// Columnar exports split aggregates into one column per field (up to 8
+// fields, no base classes); other types form a single column. Fields are
+// copied bytewise, so array and bool fields work; bools take a byte each.
+template <typename C>
+concept columnar =
+    std::is_trivially_copyable_v<C> && std::is_default_constructible_v<C>;
 
-    return {};
+// Multicast list of listeners. Publishing to an empty signal is a single
+// branch, so pools nobody listens to pay nothing on the hot path. Listeners
+// must not connect or disconnect from inside a callback.
+template <typename... Args> struct signal {
+  using listener = std::function<void(Args...)>;
+  using connection = size_t;
+
+  [[nodiscard]] inline connection connect(listener l) {
+    _listeners.emplace_back(_next_connection, std::move(l));
+    return _next_connection++;
   }
 
-  inline void remove_element_fast(entity e) {
-    assert(refcounts.size() != 0 && refcounts[forward[e]] == 0);
+  inline void disconnect(connection c) {
+    std::erase_if(_listeners, [c](const auto &l) { return l.first == c; });
+  }
 
-    const size_t idx = forward[e];
+  inline bool empty() const { return _listeners.empty(); }
 
-    const size_t last = data.size() - 1;
-    if (idx != last) {
-      std::swap<entity>(back[idx], back[last]);
-      std::swap<uint32_t>(refcounts[idx], refcounts[last]);
-      std::iter_swap(data.begin() + idx, data.begin() + last);
-      forward[back[idx]] = idx;
+  inline void publish(Args... args) const {
+    for (const auto &[_, l] : _listeners) {
+      l(args...);
     }
-
-    data.pop_back();
-    back.pop_back();
-    refcounts.pop_back();
-    forward[e] = invalid_component_index;
   }
 
-  inline std::expected<C &, error> get_element(entity e) {
-    if (forward.size() == 0 || back.size() == 0 || forward.size() <= e) {
-      return std::unexpected(error::component_does_not_exist);
-    }
-    if (forward[e] == invalid_component_index) {
-      return std::unexpected(error::component_does_not_exist);
-    }
+private:
+  std::vector<std::pair<connection, listener>> _listeners = {};
+  connection _next_connection = 0;
+};
 
-    return get_element_fast(e);
+namespace _private {
+using component_id = uint32_t;
+
+constexpr size_t invalid_component_index = std::numeric_limits<size_t>::max();
+
+inline void prefetch(const void *p) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(p, 0, 3);
+#else
+  (void)p;
+#endif
+}
+
+// std::atomic that copies its current value, so types holding one stay
+// copyable.
+template <typename T> struct copyable_atomic : std::atomic<T> {
+  using std::atomic<T>::atomic;
+  using std::atomic<T>::operator=;
+
+  inline copyable_atomic(const copyable_atomic &other)
+      : std::atomic<T>(other.load(std::memory_order_relaxed)) {}
+
+  inline copyable_atomic &operator=(const copyable_atomic &other) {
+    this->store(other.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    return *this;
   }
-  inline C &get_element_fast(entity e) { return data[forward[e]]; }
+};
 
-  inline bool has_component(entity e) const {
-    if (forward.size() == 0 || back.size() == 0 || forward.size() <= e) {
+constexpr uint64_t fnv1a(std::string_view bytes,
+                         uint64_t h = 0xcbf29ce484222325) {
+  for (char c : bytes) {
+    h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  return h;
+}
+
+// Identifies C in snapshots: its spelled name (as the compiler prints it in
+// this function's signature) plus its size and alignment.
+template <typename C> inline uint64_t type_hash() {
+  static const uint64_t hash = [] {
+    uint64_t h = fnv1a(std::source_location::current().function_name());
+    h = (h ^ sizeof(C)) * 0x100000001b3;
+    return (h ^ alignof(C)) * 0x100000001b3;
+  }();
+  return hash;
+}
+
+template <typename T> inline void write_value(std::ostream &os, const T &v) {
+  os.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+template <typename T> inline bool read_value(std::istream &is, T &v) {
+  return static_cast<bool>(is.read(reinterpret_cast<char *>(&v), sizeof(T)));
+}
+
+// Length-prefixed raw copy of a vector of trivially copyable elements.
+template <typename V> inline void write_block(std::ostream &os, const V &v) {
+  using T = typename V::value_type;
+  static_assert(std::is_trivially_copyable_v<T>);
+  write_value<uint64_t>(os, v.size());
+  os.write(reinterpret_cast<const char *>(v.data()),
+           static_cast<std::streamsize>(v.size() * sizeof(T)));
+}
+
+// Reads n raw elements into v. It grows in bounded steps, so a corrupt or
+// truncated length fails on the short read instead of allocating (or
+// overflowing) up front.
+template <typename T>
+inline bool read_elements(std::istream &is, std::vector<T> &v, uint64_t n) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  if (n > v.max_size()) {
+    return false;
+  }
+  constexpr size_t step = std::max<size_t>(1, (size_t{1} << 20) / sizeof(T));
+  v.clear();
+  while (v.size() < n) {
+    const size_t at = v.size();
+    const size_t count = std::min<size_t>(step, n - at);
+    v.resize(at + count);
+    if (!is.read(reinterpret_cast<char *>(v.data() + at),
+                 static_cast<std::streamsize>(count * sizeof(T)))) {
       return false;
     }
-
-    return forward[e] != invalid_component_index;
   }
+  return true;
+}
+
+template <typename T>
+inline bool read_block(std::istream &is, std::vector<T> &v) {
+  uint64_t n = 0;
+  return read_value(is, n) && read_elements(is, v, n);
+}
+
+// Identifies an ordered list of component types.
+template <typename... Cs> inline uint64_t schema_hash() {
+  uint64_t h = 0xcbf29ce484222325;
+  ((h = (h ^ type_hash<Cs>()) * 0x100000001b3), ...);
+  return h;
+}
+
+// Stands in for any field when counting an aggregate's fields. Each one is
+// braced so that array members are not counted element by element.
+struct any_field {
+  template <typename T> operator T() const;
 };
-} // namespace _private
 
-template <typename C> struct smart_ref {
-  smart_ref() : owner(invalid_entity), pool(nullptr) {}
+template <typename C, size_t... I>
+constexpr bool fields_fit(std::index_sequence<I...>) {
+  return requires { C{{(void(I), any_field{})}...}; };
+}
 
-  smart_ref(_private::component_pool<C> *p, entity ent) : owner(ent), pool(p) {
-    ++pool->refcounts[pool->forward[owner]];
-  }
+constexpr size_t max_split_fields = 8;
 
-  ~smart_ref() {
-    if (pool && pool->has_component(owner)) {
-      auto idx = pool->forward[owner];
-      if (idx != _private::invalid_component_index) {
-        --pool->refcounts[idx];
-      }
-    }
+template <typename C, size_t N = 0> constexpr size_t field_count() {
+  if constexpr (N <= max_split_fields &&
+                fields_fit<C>(std::make_index_sequence<N + 1>{})) {
+    return field_count<C, N + 1>();
+  } else {
+    return N;
   }
+}
 
-  smart_ref(const smart_ref &other) : owner(other.owner), pool(other.pool) {
-    if (pool && pool->has_component(owner)) {
-      ++pool->refcounts[pool->forward[owner]];
-    }
+template <size_t N, typename C> inline auto tie_fields(C &c) {
+  if constexpr (N == 1) {
+    auto &[a] = c;
+    return std::tie(a);
+  } else if constexpr (N == 2) {
+    auto &[a, b] = c;
+    return std::tie(a, b);
+  } else if constexpr (N == 3) {
+    auto &[a, b, d] = c;
+    return std::tie(a, b, d);
+  } else if constexpr (N == 4) {
+    auto &[a, b, d, e] = c;
+    return std::tie(a, b, d, e);
+  } else if constexpr (N == 5) {
+    auto &[a, b, d, e, f] = c;
+    return std::tie(a, b, d, e, f);
+  } else if constexpr (N == 6) {
+    auto &[a, b, d, e, f, g] = c;
+    return std::tie(a, b, d, e, f, g);
+  } else if constexpr (N == 7) {
+    auto &[a, b, d, e, f, g, h] = c;
+    return std::tie(a, b, d, e, f, g, h);
+  } else {
+    auto &[a, b, d, e, f, g, h, i] = c;
+    return std::tie(a, b, d, e, f, g, h, i);
   }
+}
 
-  smart_ref(smart_ref &&other) noexcept : owner(other.owner), pool(other.pool) {
-    other.pool = nullptr;
-    other.owner = invalid_entity;
+template <typename T>
+concept tuple_like = requires { std::tuple_size<T>::value; };
+
+// Element kinds, after Arrow's: bool, signed, unsigned, floating point and
+// fixed-size binary for anything else.
+template <typename T> constexpr uint8_t column_tag() {
+  if constexpr (std::is_same_v<T, bool>) {
+    return 'b';
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return 'f';
+  } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+    return 'i';
+  } else if constexpr (std::is_integral_v<T>) {
+    return 'u';
+  } else {
+    return 'x';
   }
+}
 
-  smart_ref &operator=(const smart_ref &other) {
-    if (this == &other)
-      return *this;
-    this->~smart_ref();
-    pool = other.pool;
-    owner = other.owner;
-    if (pool && pool->has_component(owner)) {
-      ++pool->refcounts[pool->forward[owner]];
+// How C is laid out in columns: field<I>(c) is the I-th column's value.
+template <typename C> struct column_layout {
+  constexpr static size_t split = [] {
+    if constexpr (std::is_aggregate_v<C> && !std::is_array_v<C> &&
+                  !tuple_like<C>) {
+      constexpr size_t n = field_count<C>();
+      return n <= max_split_fields ? n : 0;
+    } else {
+      return size_t(0);
     }
-    return *this;
-  }
+  }();
+  constexpr static size_t count = split == 0 ? 1 : split;
 
-  smart_ref &operator=(smart_ref &&other) noexcept {
-    if (this != &other) {
-      this->~smart_ref();
-      pool = other.pool;
-      owner = other.owner;
-      other.pool = nullptr;
-      other.owner = invalid_entity;
+  template <size_t I, typename T> inline static auto &field(T &c) {
+    if constexpr (split == 0) {
+      return c;
+    } else {
+      return std::get<I>(tie_fields<split>(c));
     }
-    return *this;
   }
 
-  bool valid() const {
-    if (!pool || !pool->has_component(owner))
-      return false;
-    return true;
+  template <size_t I>
+  using type = std::remove_cvref_t<decltype(field<I>(std::declval<C &>()))>;
+
+  // Whether column I has the layout of C itself, so it can be copied as is.
+  // Bools are not, since loading checks that each byte is 0 or 1.
+  template <size_t I>
+  constexpr static bool direct = count == 1 &&
+                                 sizeof(type<I>) == sizeof(C) &&
+                                 !std::is_same_v<type<I>, bool>;
+};
+
+struct columns_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t columns;
+  uint32_t reserved;
+  uint64_t rows;
+  uint64_t type_hash;
+};
+
+struct column_desc {
+  uint8_t tag;
+  uint8_t reserved[3];
+  uint32_t width;
+  uint64_t offset;
+  uint64_t bytes;
+};
+
+// Column buffers start on 64-byte boundaries, as in Arrow.
+constexpr uint64_t column_alignment = 64;
+
+constexpr uint64_t align_column(uint64_t offset) {
+  return (offset + column_alignment - 1) / column_alignment *
+         column_alignment;
+}
+
+inline void write_padding(std::ostream &os, uint64_t from, uint64_t to) {
+  static constexpr char zeros[column_alignment] = {};
+  os.write(zeros, static_cast<std::streamsize>(to - from));
+}
+
+// Lets serializer<C> append to a byte buffer through a std::ostream.
+struct append_buf : std::streambuf {
+  std::vector<char> *out = nullptr;
+
+protected:
+  inline int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      out->push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
   }
+  inline std::streamsize xsputn(const char *s, std::streamsize n) override {
+    out->insert(out->end(), s, s + n);
+    return n;
+  }
+};
 
-  C &get() {
-    assert(valid());
-    return pool->get_element_fast(owner);
+// LEB128: seven bits per byte, low bits first, high bit set on all but the
+// last byte.
+inline void append_varint(std::vector<char> &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
   }
+  out.push_back(static_cast<char>(v));
+}
 
-  void release() {
-    if (pool && pool->has_component(owner)) {
-      auto idx = pool->forward[owner];
-      if (idx != _private::invalid_component_index) {
-        --pool->refcounts[idx];
-      }
+inline bool read_varint(std::span<const char> &in, uint64_t &v) {
+  v = 0;
+  for (unsigned shift = 0; shift < 64 && !in.empty(); shift += 7) {
+    const auto byte = static_cast<uint8_t>(in.front());
+    in = in.subspan(1);
+    v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
     }
-    pool = nullptr;
-    owner = invalid_entity;
   }
+  return false;
+}
 
-  C *operator->() { return &get(); }
-  C &operator*() { return get(); }
+template <typename T> struct mapped_vector;
 
-  entity owner = invalid_entity;
+#if MM_ECS_HAS_MMAP
+constexpr uint32_t mapped_magic = 0x504d4d4d; // "MMMP"
+constexpr uint32_t mapped_version = 1;
 
-private:
-  _private::component_pool<C> *pool = nullptr;
+struct mapped_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t type_hash;
+  uint64_t element_size;
+  uint64_t size;
+  uint64_t capacity;
 };
+// Elements start one cache line into the mapping.
+constexpr size_t mapped_data_offset = 64;
+static_assert(sizeof(mapped_header) <= mapped_data_offset);
 
-template <typename... Cs> struct ecs {
-  template <safety_policy P>
-  using method_result_void_t =
-      std::conditional_t<P == safety_policy::unchecked, void,
-                         std::expected<void, error>>;
+// Vector of trivially copyable elements living in a memory mapping, with its
+// size and capacity in a header at the start of the mapping. It is anonymous
+// until opened on a file, after which the file holds the header and the
+// elements and every write lands in the page cache. Growth extends the file
+// and remaps, so like std::vector it invalidates pointers. Only appending
+// inserts are supported; allocation failures throw std::bad_alloc.
+template <typename T> struct mapped_vector {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "mapped storage needs trivially copyable elements");
+  static_assert(alignof(T) <= mapped_data_offset);
 
-  template <reference_style S, safety_policy P, typename C>
-  using method_result_ref_t = std::conditional_t<
-      P == safety_policy::unchecked,
-      std::conditional_t<S == reference_style::raw, C &, smart_ref<C>>,
-      std::expected<
-          std::conditional_t<S == reference_style::raw, C &, smart_ref<C>>,
-          error>>;
+  using value_type = T;
+  using iterator = T *;
+  using const_iterator = const T *;
 
-  template <typename C, safety_policy policy = safety_policy::unchecked,
-            typename... Ts>
-  inline method_result_void_t<policy> add_component(entity e, Ts &&...ts) {
-    if constexpr (policy == safety_policy::checked) {
-      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
-          _entities.cend()) {
-        return std::unexpected(error::no_such_entity);
-      }
+  mapped_vector() = default;
+  inline mapped_vector(const mapped_vector &other) {
+    assign(other.begin(), other.end());
+  }
+  inline mapped_vector(mapped_vector &&other) noexcept { swap(other); }
+  inline mapped_vector &operator=(mapped_vector other) noexcept {
+    swap(other);
+    return *this;
+  }
+  inline ~mapped_vector() {
+    if (_base != nullptr) {
+      ::munmap(_base, _bytes);
     }
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+  }
 
-    _private::component_pool<C> &pool =
-        std::get<_private::component_pool<C>>(_data);
+  inline void swap(mapped_vector &other) noexcept {
+    std::swap(_base, other._base);
+    std::swap(_bytes, other._bytes);
+    std::swap(_fd, other._fd);
+  }
 
-    if constexpr (policy == safety_policy::checked) {
-      return pool.add_element(e, std::forward<Ts>(ts)...);
-    } else {
-      pool.add_element_fast(e, std::forward<Ts>(ts)...);
+  // Maps the file at path (or the POSIX shared memory object of that name),
+  // creating it empty if it does not exist. An existing file is only checked
+  // through its header; its pages are read lazily as they are touched.
+  inline static std::expected<mapped_vector, error>
+  open(const std::string &path, uint64_t type_hash,
+       bool shared_memory = false) {
+    mapped_vector v;
+    v._fd = shared_memory ? ::shm_open(path.c_str(), O_RDWR | O_CREAT, 0600)
+                          : ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st = {};
+    if (v._fd < 0 || ::fstat(v._fd, &st) != 0) {
+      return std::unexpected(error::mapping_failed);
     }
-  }
 
-  template <typename C, safety_policy policy = safety_policy::unchecked>
-  inline method_result_void_t<policy> remove_component(entity e) {
-    if constexpr (policy == safety_policy::checked) {
-      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
-          _entities.cend()) {
-        return std::unexpected(error::no_such_entity);
+    const size_t file_bytes = static_cast<size_t>(st.st_size);
+    if (file_bytes == 0) {
+      v._bytes = page_round(mapped_data_offset + sizeof(T));
+      if (::ftruncate(v._fd, static_cast<off_t>(v._bytes)) != 0 ||
+          !v.map_file()) {
+        return std::unexpected(error::mapping_failed);
       }
+      v.header() = {mapped_magic, mapped_version, type_hash, sizeof(T), 0,
+                    (v._bytes - mapped_data_offset) / sizeof(T)};
+      return v;
     }
-    _private::component_pool<C> &pool =
-        std::get<_private::component_pool<C>>(_data);
 
-    if constexpr (policy == safety_policy::checked) {
-      return pool.remove_element(e);
-    } else {
-      pool.remove_element_fast(e);
+    if (file_bytes < mapped_data_offset) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    v._bytes = file_bytes;
+    if (!v.map_file()) {
+      return std::unexpected(error::mapping_failed);
+    }
+    const mapped_header &h = v.header();
+    if (h.magic != mapped_magic || h.version != mapped_version ||
+        h.type_hash != type_hash || h.element_size != sizeof(T) ||
+        h.size > h.capacity ||
+        mapped_data_offset + h.capacity * sizeof(T) > file_bytes) {
+      return std::unexpected(error::snapshot_incompatible);
     }
+    return v;
   }
 
-  template <typename C, reference_style style = reference_style::raw,
-            safety_policy policy = safety_policy::unchecked>
-  [[nodiscard(
-      "Unused get_component")]] inline method_result_ref_t<style, policy, C>
-  get_component(entity e) {
-    if constexpr (policy == safety_policy::checked) {
-      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
-          _entities.cend()) {
-        return std::unexpected(error::no_such_entity);
-      }
+  // Writes dirty pages of a file-backed vector back to the file.
+  inline void sync() {
+    if (_fd >= 0 && _base != nullptr) {
+      ::msync(_base, _bytes, MS_SYNC);
     }
+  }
 
-    auto &pool = std::get<_private::component_pool<C>>(_data);
-
-    if constexpr (policy == safety_policy::checked) {
-      if constexpr (style == reference_style::raw) {
-        return pool.get_element(e);
-      } else {
-        if (!pool.has_component(e))
-          return std::unexpected(error::component_does_not_exist);
-        return smart_ref<C>{&pool, e};
-      }
-    } else {
-      if constexpr (style == reference_style::raw) {
-        return pool.get_element_fast(e);
-      } else {
-        return smart_ref<C>{&pool, e};
-      }
-    }
+  inline size_t size() const { return _base ? header().size : 0; }
+  inline size_t capacity() const { return _base ? header().capacity : 0; }
+  inline bool empty() const { return size() == 0; }
+  constexpr size_t max_size() const {
+    return std::numeric_limits<size_t>::max() / sizeof(T);
   }
 
-  template <typename C> bool has_component(entity e) {
-    _private::component_pool<C> &pool =
-        std::get<_private::component_pool<C>>(_data);
-    return pool.has_component(e);
+  inline T *data() {
+    return _base ? reinterpret_cast<T *>(_base + mapped_data_offset)
+                 : nullptr;
+  }
+  inline const T *data() const {
+    return _base ? reinterpret_cast<const T *>(_base + mapped_data_offset)
+                 : nullptr;
   }
+  inline T *begin() { return data(); }
+  inline T *end() { return data() + size(); }
+  inline const T *begin() const { return data(); }
+  inline const T *end() const { return data() + size(); }
+  inline T &operator[](size_t i) { return data()[i]; }
+  inline const T &operator[](size_t i) const { return data()[i]; }
+  inline T &back() { return data()[size() - 1]; }
 
-  template <remove_policy rem_policy = remove_policy::lax,
-            safety_policy saf_policy = safety_policy::unchecked,
-            typename... Ccs>
-  inline method_result_void_t<saf_policy> remove_components(entity e) {
-    if constexpr (saf_policy == safety_policy::checked) {
-      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
-          _entities.cend()) {
-        return std::unexpected(error::no_such_entity);
-      }
+  inline void reserve(size_t n) {
+    if (n > capacity()) {
+      grow_to(n);
     }
+  }
 
-    auto checked_remove =
-        []<typename C>(_private::component_pool<C> &pool,
+  template <typename... Args> inline T &emplace_back(Args &&...args) {
+    if (size() == capacity()) {
+      // The arguments may refer to an element, and growing can move the
+      // mapping, so the value is built first.
+      T value(std::forward<Args>(args)...);
+      grow_to(std::max<size_t>(2 * capacity(), 1));
+      T *slot = data() + header().size++;
+      return *::new (static_cast<void *>(slot)) T(std::move(value));
+    }
+    T *slot = data() + header().size++;
+    return *::new (static_cast<void *>(slot)) T(std::forward<Args>(args)...);
+  }
+  inline void push_back(const T &v) { emplace_back(v); }
+  inline void pop_back() { --header().size; }
+  inline void clear() {
+    if (_base != nullptr) {
+      header().size = 0;
+    }
+  }
+
+  inline void resize(size_t n, const T &v = T()) {
+    reserve(n);
+    if (n > size()) {
+      std::uninitialized_fill(end(), data() + n, v);
+    }
+    if (_base != nullptr) {
+      header().size = n;
+    }
+  }
+
+  template <typename It> inline T *insert(T *pos, It first, It last) {
+    assert(pos == end() && "mapped_vector only appends");
+    const size_t at = static_cast<size_t>(pos - data());
+    reserve(size() + static_cast<size_t>(std::distance(first, last)));
+    for (; first != last; ++first) {
+      emplace_back(*first);
+    }
+    return data() + at;
+  }
+
+  template <typename It> inline void assign(It first, It last) {
+    clear();
+    insert(end(), first, last);
+  }
+
+private:
+  inline static size_t page_round(size_t bytes) {
+    const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return (bytes + page - 1) / page * page;
+  }
+
+  inline mapped_header &header() {
+    return *reinterpret_cast<mapped_header *>(_base);
+  }
+  inline const mapped_header &header() const {
+    return *reinterpret_cast<const mapped_header *>(_base);
+  }
+
+  inline bool map_file() {
+    void *p = ::mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     _fd, 0);
+    _base = p == MAP_FAILED ? nullptr : static_cast<char *>(p);
+    return _base != nullptr;
+  }
+
+  inline void grow_to(size_t n) {
+    const size_t bytes = page_round(
+        mapped_data_offset + std::max(n, 2 * capacity()) * sizeof(T));
+    if (_base == nullptr) {
+      void *p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      _base = static_cast<char *>(p);
+      header() = {mapped_magic, mapped_version, 0, sizeof(T), 0, 0};
+    } else {
+      if (_fd >= 0 && ::ftruncate(_fd, static_cast<off_t>(bytes)) != 0) {
+        throw std::bad_alloc();
+      }
+#ifdef MREMAP_MAYMOVE
+      void *p = ::mremap(_base, _bytes, bytes, MREMAP_MAYMOVE);
+      if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      _base = static_cast<char *>(p);
+#else
+      void *p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       _fd >= 0 ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS,
+                       _fd, 0);
+      if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      if (_fd < 0) {
+        std::memcpy(p, _base, _bytes);
+      }
+      ::munmap(_base, _bytes);
+      _base = static_cast<char *>(p);
+#endif
+    }
+    _bytes = bytes;
+    header().capacity = (bytes - mapped_data_offset) / sizeof(T);
+  }
+
+  char *_base = nullptr;
+  size_t _bytes = 0;
+  int _fd = -1;
+};
+
+// Read-only view of a mapped_vector living in POSIX shared memory, from
+// another process. The writer may grow the object at any time; refresh()
+// extends the mapping to the object's current size, and size() never
+// reports more elements than are mapped.
+template <typename T> struct shared_array {
+  shared_array() = default;
+  shared_array(const shared_array &) = delete;
+  shared_array &operator=(const shared_array &) = delete;
+  inline shared_array(shared_array &&other) noexcept { swap(other); }
+  inline shared_array &operator=(shared_array &&other) noexcept {
+    swap(other);
+    return *this;
+  }
+  inline ~shared_array() {
+    if (_base != nullptr) {
+      ::munmap(const_cast<char *>(_base), _bytes);
+    }
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+  }
+
+  inline void swap(shared_array &other) noexcept {
+    std::swap(_base, other._base);
+    std::swap(_bytes, other._bytes);
+    std::swap(_fd, other._fd);
+  }
+
+  inline static std::expected<shared_array, error>
+  open(const std::string &name, uint64_t type_hash) {
+    shared_array a;
+    a._fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (a._fd < 0 || !a.refresh()) {
+      return std::unexpected(error::mapping_failed);
+    }
+    const mapped_header &h = a.header();
+    if (a._bytes < mapped_data_offset || h.magic != mapped_magic ||
+        h.version != mapped_version || h.type_hash != type_hash ||
+        h.element_size != sizeof(T)) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    return a;
+  }
+
+  inline bool refresh() {
+    struct stat st = {};
+    if (::fstat(_fd, &st) != 0) {
+      return false;
+    }
+    const size_t bytes = static_cast<size_t>(st.st_size);
+    if (bytes <= _bytes) {
+      return true;
+    }
+    void *p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    if (_base != nullptr) {
+      ::munmap(const_cast<char *>(_base), _bytes);
+    }
+    _base = static_cast<const char *>(p);
+    _bytes = bytes;
+    return true;
+  }
+
+  inline size_t size() const {
+    const uint64_t n =
+        std::atomic_ref<uint64_t>(const_cast<uint64_t &>(header().size))
+            .load(std::memory_order_relaxed);
+    return std::min<size_t>(n, (_bytes - mapped_data_offset) / sizeof(T));
+  }
+
+  inline const T *data() const {
+    return reinterpret_cast<const T *>(_base + mapped_data_offset);
+  }
+
+  inline std::span<const T> span() const { return {data(), size()}; }
+
+private:
+  inline const mapped_header &header() const {
+    return *reinterpret_cast<const mapped_header *>(_base);
+  }
+
+  const char *_base = nullptr;
+  size_t _bytes = 0;
+  int _fd = -1;
+};
+
+// Slots of the control object shared by a shm_writer and its readers.
+enum shared_slot : size_t { shared_seq, shared_counter, shared_slots };
+#endif
+
+// A std::vector whose buffer is shared between copies until one of them
+// writes: every non-const member first takes a private copy if the buffer is
+// shared, so copying is O(1) and the first write pays for the copy. Const
+// members never copy. Not safe to write from several threads at once, even
+// through different copies, while the buffer may be shared.
+template <typename T> struct cow_vector {
+  using value_type = T;
+  using iterator = typename std::vector<T>::iterator;
+  using const_iterator = typename std::vector<T>::const_iterator;
+
+  cow_vector() = default;
+  inline cow_vector(std::vector<T> &&v)
+      : _v(std::make_shared<std::vector<T>>(std::move(v))) {}
+  inline cow_vector &operator=(std::vector<T> &&v) {
+    _v = std::make_shared<std::vector<T>>(std::move(v));
+    return *this;
+  }
+
+  inline const std::vector<T> &read() const {
+    static const std::vector<T> none = {};
+    return _v ? *_v : none;
+  }
+
+  inline std::vector<T> &write() {
+    if (!_v) {
+      _v = std::make_shared<std::vector<T>>();
+    } else if (_v.use_count() != 1) {
+      _v = std::make_shared<std::vector<T>>(*_v);
+    }
+    return *_v;
+  }
+
+  inline bool shares_with(const cow_vector &other) const {
+    return _v && _v == other._v;
+  }
+
+  inline size_t size() const { return read().size(); }
+  inline size_t capacity() const { return read().capacity(); }
+  inline bool empty() const { return read().empty(); }
+  inline size_t max_size() const { return read().max_size(); }
+  inline const T *data() const { return read().data(); }
+  inline const_iterator begin() const { return read().begin(); }
+  inline const_iterator end() const { return read().end(); }
+  inline const_iterator cbegin() const { return read().cbegin(); }
+  inline const_iterator cend() const { return read().cend(); }
+  inline const T &operator[](size_t i) const { return read()[i]; }
+  inline const T &back() const { return read().back(); }
+
+  inline T *data() { return write().data(); }
+  inline iterator begin() { return write().begin(); }
+  inline iterator end() { return write().end(); }
+  inline T &operator[](size_t i) { return write()[i]; }
+  inline T &back() { return write().back(); }
+
+  template <typename... Args> inline T &emplace_back(Args &&...args) {
+    return write().emplace_back(std::forward<Args>(args)...);
+  }
+  inline void push_back(const T &v) { write().push_back(v); }
+  inline void push_back(T &&v) { write().push_back(std::move(v)); }
+  inline void pop_back() { write().pop_back(); }
+  inline void reserve(size_t n) { write().reserve(n); }
+  inline void resize(size_t n) { write().resize(n); }
+  inline void resize(size_t n, const T &v) { write().resize(n, v); }
+  inline void clear() { write().clear(); }
+
+  // Positions are taken as offsets before the buffer is detached, so
+  // iterators from either side may be passed.
+  template <typename It>
+  inline iterator insert(const_iterator pos, It first, It last) {
+    const auto at = pos - read().cbegin();
+    auto &v = write();
+    return v.insert(v.cbegin() + at, first, last);
+  }
+  inline iterator erase(const_iterator pos) {
+    const auto at = pos - read().cbegin();
+    auto &v = write();
+    return v.erase(v.cbegin() + at);
+  }
+  template <typename It> inline void assign(It first, It last) {
+    write().assign(first, last);
+  }
+  inline void assign(size_t n, const T &v) {
+    _v = std::make_shared<std::vector<T>>(n, v);
+  }
+
+private:
+  std::shared_ptr<std::vector<T>> _v = {};
+};
+
+// Storage of a pool array holding T for component C.
+template <typename C, typename T>
+using pool_array = std::conditional_t<
+    component_traits<C>::storage == pool_storage::mapped, mapped_vector<T>,
+    std::conditional_t<component_traits<C>::storage ==
+                           pool_storage::copy_on_write,
+                       cow_vector<T>, std::vector<T>>>;
+
+static_assert(std::atomic_ref<uint32_t>::required_alignment ==
+              alignof(uint32_t));
+static_assert(std::atomic_ref<size_t>::required_alignment == alignof(size_t));
+
+// `live` is the pool's running total of references, kept for stats; it
+// orders nothing, so it is updated relaxed.
+template <refcount_policy R>
+inline void acquire_ref(uint32_t &count, size_t &live) {
+  if constexpr (R == refcount_policy::atomic) {
+    std::atomic_ref<uint32_t>(count).fetch_add(1, std::memory_order_relaxed);
+    std::atomic_ref<size_t>(live).fetch_add(1, std::memory_order_relaxed);
+  } else {
+    ++count;
+    ++live;
+  }
+}
+
+// The last drop synchronises with the removal that may follow it.
+template <refcount_policy R>
+inline void release_ref(uint32_t &count, size_t &live) {
+  if constexpr (R == refcount_policy::atomic) {
+    std::atomic_ref<size_t>(live).fetch_sub(1, std::memory_order_relaxed);
+    if (std::atomic_ref<uint32_t>(count).fetch_sub(
+            1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+  } else {
+    --count;
+    --live;
+  }
+}
+
+template <refcount_policy R> inline uint32_t load_ref(uint32_t &count) {
+  if constexpr (R == refcount_policy::atomic) {
+    return std::atomic_ref<uint32_t>(count).load(std::memory_order_acquire);
+  } else {
+    return count;
+  }
+}
+
+// Read side of a double-buffered pool. `data` mirrors the pool's own data
+// slot for slot (same back/forward) but holds the values published at the
+// last swap. Slots written since then are listed in `dirty` once each,
+// detected by stamping them with the current frame.
+template <typename C> struct read_buffer {
+  std::vector<C> data = {};
+  std::vector<uint32_t> stamps = {};
+  std::vector<entity> dirty = {};
+  uint32_t frame = 1;
+  bool all_dirty = false;
+};
+struct no_read_buffer {};
+
+// Entities whose component was added, written or removed since the last
+// delta, see ecs::save_delta. Stamps are indexed by entity, since slots move
+// on removal. all is set when the pool was replaced wholesale or handed out
+// mutable access it cannot follow element by element (a view's components()
+// span), and makes the whole pool part of the next delta.
+struct change_log {
+  std::vector<entity> changed = {};
+  std::vector<uint32_t> stamps = {};
+  uint32_t epoch = 1;
+  bool enabled = false;
+  bool all = false;
+
+  inline void mark(entity e) {
+    if (e >= stamps.size()) {
+      stamps.resize(static_cast<size_t>(e) + 1, 0);
+    }
+    if (stamps[e] != epoch) {
+      stamps[e] = epoch;
+      changed.push_back(e);
+    }
+  }
+
+  inline void reset() {
+    changed.clear();
+    all = false;
+    ++epoch;
+  }
+};
+
+// A pointer that does not survive copies, for hooks owned by something other
+// than the object holding it.
+template <typename T> struct detached_ptr {
+  T *ptr = nullptr;
+
+  detached_ptr() = default;
+  inline detached_ptr(T *p) : ptr(p) {}
+  inline detached_ptr(const detached_ptr &) {}
+  inline detached_ptr &operator=(const detached_ptr &) { return *this; }
+  inline detached_ptr &operator=(T *p) {
+    ptr = p;
+    return *this;
+  }
+
+  inline T *operator->() const { return ptr; }
+  inline explicit operator bool() const { return ptr != nullptr; }
+};
+
+// Fixed number of frames reused in a circle: the newest one is open and
+// collects changes, and once the ring is full opening a new frame drops the
+// oldest.
+template <typename Frame> struct frame_ring {
+  inline explicit frame_ring(size_t capacity) : _frames(capacity) {
+    assert(capacity > 0);
+  }
+
+  inline Frame &open() { return _frames[_head]; }
+  inline size_t size() const { return _count; }
+
+  inline Frame &advance() {
+    _head = (_head + 1) % _frames.size();
+    _count = std::min(_count + 1, _frames.size());
+    _frames[_head].clear();
+    return _frames[_head];
+  }
+
+  // Hands the n newest frames to f, newest first, then drops all but the
+  // last of them, which is cleared and becomes the open frame.
+  template <typename F> inline void rewind(size_t n, F &&f) {
+    assert(n >= 1 && n <= _count);
+    for (size_t k = 0; k < n; ++k) {
+      Frame &frame = _frames[(_head + _frames.size() - k) % _frames.size()];
+      f(frame);
+      frame.clear();
+    }
+    _head = (_head + _frames.size() - (n - 1)) % _frames.size();
+    _count -= n - 1;
+  }
+
+private:
+  std::vector<Frame> _frames;
+  size_t _head = 0;
+  size_t _count = 1;
+};
+
+// What it takes to undo a frame's changes to one pool: the old value of each
+// component on its first write, the slot and value of each removal, each
+// addition and, once the whole pool was handed out at once (a view's
+// components() span), a copy of its arrays.
+// Undone newest first, this restores the arrays exactly, slots included.
+template <typename C> struct undo_log {
+  enum class op : uint8_t { written, added, removed };
+  struct entry {
+    op kind;
+    entity e;
+    size_t idx;
+    size_t value;
+  };
+
+  struct frame {
+    std::vector<entry> entries = {};
+    std::vector<C> values = {};
+    bool copied = false;
+    std::vector<C> data = {};
+    std::vector<entity> back = {};
+    std::vector<size_t> forward = {};
+
+    inline void clear() {
+      entries.clear();
+      values.clear();
+      copied = false;
+      data.clear();
+      back.clear();
+      forward.clear();
+    }
+  };
+
+  inline explicit undo_log(size_t capacity) : ring(capacity) {}
+
+  inline void written(entity e, const C &old) {
+    frame &f = ring.open();
+    if (!f.copied && _first_touch(e)) {
+      f.entries.push_back({op::written, e, 0, f.values.size()});
+      f.values.push_back(old);
+    }
+  }
+
+  // Takes the size of forward before the addition, which undoing it
+  // restores.
+  inline void added(entity e, size_t forward_size) {
+    frame &f = ring.open();
+    if (!f.copied) {
+      _first_touch(e);
+      f.entries.push_back({op::added, e, forward_size, 0});
+    }
+  }
+
+  inline void removed(entity e, size_t idx, const C &old) {
+    frame &f = ring.open();
+    if (!f.copied) {
+      _first_touch(e);
+      f.entries.push_back({op::removed, e, idx, f.values.size()});
+      f.values.push_back(old);
+    }
+  }
+
+  template <typename Pool> inline void copy(const Pool &pool) {
+    frame &f = ring.open();
+    if (!f.copied) {
+      f.copied = true;
+      f.data.assign(pool.data.begin(), pool.data.end());
+      f.back.assign(pool.back.begin(), pool.back.end());
+      f.forward.assign(pool.forward.begin(), pool.forward.end());
+    }
+  }
+
+  inline void next_frame() {
+    ring.advance();
+    ++_epoch;
+  }
+
+  template <typename F> inline void rewind(size_t n, F &&f) {
+    ring.rewind(n, std::forward<F>(f));
+    ++_epoch;
+  }
+
+  frame_ring<frame> ring;
+
+private:
+  inline bool _first_touch(entity e) {
+    if (e >= _stamps.size()) {
+      _stamps.resize(static_cast<size_t>(e) + 1, 0);
+    }
+    const bool first = _stamps[e] != _epoch;
+    _stamps[e] = _epoch;
+    return first;
+  }
+
+  std::vector<uint32_t> _stamps = {};
+  uint32_t _epoch = 1;
+};
+
+template <typename C> struct component_pool {
+  constexpr static bool double_buffered = component_traits<C>::double_buffered;
+  static_assert(!double_buffered || std::is_copy_assignable_v<C>,
+                "double-buffered components must be copy assignable");
+  constexpr static bool mapped =
+      component_traits<C>::storage == pool_storage::mapped;
+  static_assert(!mapped || (MM_ECS_HAS_MMAP && !double_buffered &&
+                            std::is_trivially_copyable_v<C>),
+                "mapped pools need mmap, a trivially copyable component and "
+                "no double buffering");
+  constexpr static bool copy_on_write =
+      component_traits<C>::storage == pool_storage::copy_on_write;
+  static_assert(!copy_on_write ||
+                    (!double_buffered && component_traits<C>::refcount ==
+                                             refcount_policy::plain),
+                "copy-on-write pools cannot be double-buffered or use atomic "
+                "refcounts");
+
+  pool_array<C, C> data = {};
+  pool_array<C, entity> back = {};
+  pool_array<C, size_t> forward = {};
+
+  std::conditional_t<copy_on_write, cow_vector<uint32_t>,
+                     std::vector<uint32_t>>
+      refcounts = {};
+  // Live smart_refs into the pool: reported by stats, and tells a fork of a
+  // copy-on-write pool whether it may share refcounts.
+  size_t live_refs = 0;
+  // Counted for stats, cleared by reset_stats.
+  uint64_t added = 0;
+  uint64_t removed = 0;
+
+  [[no_unique_address]] std::conditional_t<double_buffered, read_buffer<C>,
+                                           no_read_buffer>
+      previous = {};
+
+  change_log changes = {};
+  // Set while a world_history records this pool.
+  detached_ptr<undo_log<C>> undo = {};
+
+  // Fired after a component is added, after it is replaced and right before
+  // it is removed (while it is still readable).
+  signal<entity, C &> on_construct = {};
+  signal<entity, C &> on_update = {};
+  signal<entity, C &> on_destroy = {};
+
+  template <typename... Args>
+  inline std::expected<void, error> add_element(entity e, Args &&...args) {
+    // add_element_fast grows forward itself, after logging its old size.
+    if (e < forward.size() &&
+        std::as_const(forward)[e] != invalid_component_index) {
+      return std::unexpected(error::component_already_exists);
+    }
+
+    add_element_fast(e, std::forward<Args>(args)...);
+
+    return {};
+  }
+
+  template <typename... Args>
+  inline void add_element_fast(entity e, Args &&...args) {
+    static_assert(std::is_constructible_v<C, Args &&...>,
+                  "add_element_fast(): arguments do not match any constructor "
+                  "of this component type");
+    if (undo) [[unlikely]] {
+      undo->added(e, forward.size());
+    }
+    if (e >= forward.size()) {
+      forward.resize(e + 1, invalid_component_index);
+    }
+
+    forward[e] = back.size();
+    back.push_back(e);
+
+    if constexpr (sizeof...(Args) == 0) {
+      data.emplace_back();
+    } else {
+      data.emplace_back(std::forward<Args>(args)...);
+    }
+
+    refcounts.push_back(0);
+    mirror_appended(back.size() - 1);
+    mark_changed(e);
+    ++added;
+
+    if (!on_construct.empty()) [[unlikely]] {
+      on_construct.publish(e, data.back());
+    }
+  }
+
+  template <typename... Args>
+  inline std::expected<void, error> replace_element(entity e, Args &&...args) {
+    if (!has_component(e)) {
+      return std::unexpected(error::component_does_not_exist);
+    }
+
+    replace_element_fast(e, std::forward<Args>(args)...);
+
+    return {};
+  }
+
+  template <typename... Args>
+  inline void replace_element_fast(entity e, Args &&...args) {
+    static_assert(std::is_constructible_v<C, Args &&...>,
+                  "replace_element_fast(): arguments do not match any "
+                  "constructor of this component type");
+    const size_t idx = std::as_const(forward)[e];
+    touch(idx);
+    C &c = data[idx];
+    if constexpr (sizeof...(Args) == 0) {
+      c = C();
+    } else {
+      c = C(std::forward<Args>(args)...);
+    }
+
+    if (!on_update.empty()) [[unlikely]] {
+      on_update.publish(e, c);
+    }
+  }
+
+  template <typename F> inline void patch_element_fast(entity e, F &&f) {
+    const size_t idx = std::as_const(forward)[e];
+    touch(idx);
+    C &c = data[idx];
+    std::invoke(std::forward<F>(f), c);
+
+    if (!on_update.empty()) [[unlikely]] {
+      on_update.publish(e, c);
+    }
+  }
+
+  inline std::expected<void, error> remove_element(entity e) {
+    if (forward.size() == 0 || back.size() == 0) {
+      return std::unexpected(error::component_does_not_exist);
+    }
+    if (forward[e] == invalid_component_index) {
+      return std::unexpected(error::component_does_not_exist);
+    }
+    if (load_ref<component_traits<C>::refcount>(refcounts[forward[e]]) != 0) {
+      return std::unexpected(error::component_has_references);
+    }
+
+    remove_element_fast(e);
+
+    return {};
+  }
+
+  inline void remove_element_fast(entity e) {
+    assert(refcounts.size() != 0 && refcounts[forward[e]] == 0);
+
+    const size_t idx = forward[e];
+    mark_changed(e);
+    ++removed;
+    if (undo) [[unlikely]] {
+      undo->removed(e, idx, data[idx]);
+    }
+
+    if (!on_destroy.empty()) [[unlikely]] {
+      on_destroy.publish(e, data[idx]);
+    }
+
+    const size_t last = data.size() - 1;
+    if (idx != last) {
+      std::swap<entity>(back[idx], back[last]);
+      std::swap<uint32_t>(refcounts[idx], refcounts[last]);
+      std::iter_swap(data.begin() + idx, data.begin() + last);
+      if constexpr (double_buffered) {
+        std::iter_swap(previous.data.begin() + idx,
+                       previous.data.begin() + last);
+        std::swap(previous.stamps[idx], previous.stamps[last]);
+      }
+      forward[back[idx]] = idx;
+    }
+
+    data.pop_back();
+    back.pop_back();
+    refcounts.pop_back();
+    if constexpr (double_buffered) {
+      previous.data.pop_back();
+      previous.stamps.pop_back();
+    }
+    forward[e] = invalid_component_index;
+  }
+
+  inline std::expected<C &, error> get_element(entity e) {
+    if (forward.size() == 0 || back.size() == 0 || forward.size() <= e) {
+      return std::unexpected(error::component_does_not_exist);
+    }
+    if (std::as_const(forward)[e] == invalid_component_index) {
+      return std::unexpected(error::component_does_not_exist);
+    }
+
+    return get_element_fast(e);
+  }
+  inline C &get_element_fast(entity e) {
+    const size_t idx = std::as_const(forward)[e];
+    touch(idx);
+    return data[idx];
+  }
+  inline const C &get_element_fast(entity e) const {
+    return data[forward[e]];
+  }
+
+  // Every mutable access marks its slot as written: for the next buffer swap
+  // of a double-buffered pool, for the next delta while changes are tracked
+  // and in the undo log while a history is recorded. Only the slot's data
+  // is written, so the other arrays are read through const access and a
+  // copy-on-write pool does not detach them.
+  inline void touch(size_t idx) {
+    const entity e = std::as_const(back)[idx];
+    if (undo) [[unlikely]] {
+      undo->written(e, std::as_const(data)[idx]);
+    }
+    if constexpr (double_buffered) {
+      if (previous.stamps[idx] != previous.frame) {
+        previous.stamps[idx] = previous.frame;
+        previous.dirty.push_back(e);
+      }
+    }
+    mark_changed(e);
+  }
+
+  // Whether touch has anything to record. Views check it once, so iterating
+  // a pool nobody follows costs no branch per element.
+  inline bool tracks_writes() const {
+    return double_buffered || changes.enabled || undo;
+  }
+
+  // Marks the whole pool as written, for accesses that hand out every
+  // element at once.
+  inline void touch_all() {
+    if constexpr (double_buffered) {
+      previous.all_dirty = true;
+    }
+    mark_all_changed();
+  }
+
+  inline void mark_changed(entity e) {
+    if (changes.enabled) [[unlikely]] {
+      changes.mark(e);
+    }
+  }
+
+  inline void mark_all_changed() {
+    if (changes.enabled) [[unlikely]] {
+      changes.all = true;
+    }
+    if (undo) [[unlikely]] {
+      undo->copy(*this);
+    }
+  }
+
+  // Publishes every element to a signal. Bulk paths that swap the arrays
+  // wholesale call this for the old and new contents, so indices kept by
+  // listeners stay in step.
+  inline void publish_all(signal<entity, C &> &s) {
+    if (!s.empty()) [[unlikely]] {
+      for (size_t i = 0; i < back.size(); ++i) {
+        s.publish(std::as_const(back)[i], data[i]);
+      }
+    }
+  }
+
+  // Undoes one frame of the undo log, newest change first. Listeners are
+  // notified as for the inverse operations; the undone entities show up in
+  // the next delta.
+  inline void undo_frame(typename undo_log<C>::frame &f) {
+    using op = typename undo_log<C>::op;
+    if (f.copied) {
+      publish_all(on_destroy);
+      removed += back.size();
+      added += f.back.size();
+      data.assign(f.data.begin(), f.data.end());
+      back.assign(f.back.begin(), f.back.end());
+      forward.assign(f.forward.begin(), f.forward.end());
+      refcounts.assign(back.size(), 0);
+      mark_all_changed();
+      publish_all(on_construct);
+    }
+    for (auto it = f.entries.rbegin(); it != f.entries.rend(); ++it) {
+      const entity e = it->e;
+      mark_changed(e);
+      switch (it->kind) {
+      case op::written:
+        data[forward[e]] = std::move(f.values[it->value]);
+        if (!on_update.empty()) [[unlikely]] {
+          on_update.publish(e, data[forward[e]]);
+        }
+        break;
+      case op::added:
+        assert(back.back() == e && refcounts.back() == 0);
+        if (!on_destroy.empty()) [[unlikely]] {
+          on_destroy.publish(e, data.back());
+        }
+        ++removed;
+        data.pop_back();
+        back.pop_back();
+        refcounts.pop_back();
+        forward[e] = invalid_component_index;
+        forward.resize(it->idx);
+        break;
+      case op::removed: {
+        data.push_back(std::move(f.values[it->value]));
+        back.push_back(e);
+        refcounts.push_back(0);
+        const size_t last = back.size() - 1;
+        if (it->idx != last) {
+          std::iter_swap(data.begin() + it->idx, data.begin() + last);
+          std::swap<entity>(back[it->idx], back[last]);
+          std::swap<uint32_t>(refcounts[it->idx], refcounts[last]);
+          forward[back[last]] = last;
+        }
+        forward[e] = it->idx;
+        ++added;
+        if (!on_construct.empty()) [[unlikely]] {
+          on_construct.publish(e, data[it->idx]);
+        }
+        break;
+      }
+      }
+    }
+    if constexpr (double_buffered) {
+      previous = {};
+      mirror_appended(0);
+    }
+  }
+
+  // Copies data[first..] to the read side after elements were appended, so
+  // both buffers keep the same layout. New elements are visible to readers
+  // immediately.
+  inline void mirror_appended(size_t first) {
+    if constexpr (double_buffered) {
+      previous.data.insert(previous.data.end(), data.begin() + first,
+                           data.end());
+      previous.stamps.resize(data.size(), 0);
+    }
+  }
+
+  // Publishes this frame's writes: the buffers trade places in O(1), then the
+  // new write side catches up on the slots written this frame, so the cost
+  // is proportional to what changed rather than to the pool size.
+  inline void swap_buffers() {
+    if constexpr (double_buffered) {
+      std::swap(data, previous.data);
+      if (previous.all_dirty) {
+        data = previous.data;
+      } else {
+        for (entity e : previous.dirty) {
+          if (has_component(e)) {
+            data[forward[e]] = previous.data[forward[e]];
+          }
+        }
+      }
+      previous.dirty.clear();
+      previous.all_dirty = false;
+      ++previous.frame;
+    }
+  }
+
+  // A copy for a forked world: copy-on-write arrays are shared rather than
+  // copied. The copy has no listeners, references or change tracking.
+  inline component_pool fork() const {
+    component_pool p;
+    p.data = data;
+    p.back = back;
+    p.forward = forward;
+    if constexpr (copy_on_write) {
+      if (live_refs == 0) {
+        p.refcounts = refcounts;
+        return p;
+      }
+    }
+    p.refcounts.assign(back.size(), 0);
+    p.previous = previous;
+    return p;
+  }
+
+  // Snapshot of the sparse set and its data. Refcounts are not saved: a
+  // restored pool has no references.
+  inline void save(std::ostream &os) const
+    requires snapshottable<C>
+  {
+    constexpr bool raw = !has_serializer<C>;
+    write_value<uint64_t>(os, type_hash<C>());
+    write_value<uint8_t>(os, raw);
+    write_block(os, back);
+    write_block(os, forward);
+    if constexpr (raw) {
+      write_block(os, data);
+    } else {
+      for (const C &c : data) {
+        serializer<C>::save(os, c);
+      }
+    }
+  }
+
+  // Parsed but not yet installed pool contents, so a failed load leaves the
+  // world untouched.
+  struct image {
+    std::vector<C> data = {};
+    std::vector<entity> back = {};
+    std::vector<size_t> forward = {};
+  };
+
+  inline static std::expected<image, error> load(std::istream &is)
+    requires snapshottable<C>
+  {
+    constexpr bool raw = !has_serializer<C>;
+    uint64_t hash = 0;
+    uint8_t stored_raw = 0;
+    if (!read_value(is, hash) || !read_value(is, stored_raw)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if (hash != type_hash<C>() || stored_raw != raw) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+
+    image img;
+    if (!read_block(is, img.back) || !read_block(is, img.forward)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if constexpr (raw) {
+      if (!read_block(is, img.data)) {
+        return std::unexpected(error::snapshot_io_failed);
+      }
+    } else {
+      img.data.reserve(img.back.size());
+      for (size_t i = 0; i < img.back.size() && is; ++i) {
+        img.data.push_back(serializer<C>::load(is));
+      }
+      if (!is) {
+        return std::unexpected(error::snapshot_io_failed);
+      }
+    }
+    if (img.data.size() != img.back.size()) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    if (!consistent(img.back, img.forward)) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    return img;
+  }
+
+  // Whether a sparse set read from outside is well formed: every dense slot
+  // is indexed by its entity's forward entry and no other forward entry is
+  // set.
+  template <typename B, typename F>
+  inline static bool consistent(const B &back, const F &forward) {
+    for (size_t i = 0; i < back.size(); ++i) {
+      if (back[i] >= forward.size() || forward[back[i]] != i) {
+        return false;
+      }
+    }
+    const size_t set =
+        forward.size() - static_cast<size_t>(std::count(
+                             forward.begin(), forward.end(),
+                             invalid_component_index));
+    return set == back.size();
+  }
+
+  // Installs a loaded image. Listeners see the old contents destroyed and
+  // the new ones constructed.
+  inline void restore(image &&img) {
+    publish_all(on_destroy);
+    install(std::move(img));
+    changes.reset();
+    publish_all(on_construct);
+  }
+
+  // Installs an image as one bulk write: the old contents go to the undo
+  // log, and entities that lose or gain the component show up in the next
+  // delta. Listeners are notified as for restore.
+  inline void replace(image &&img) {
+    mark_all_changed();
+    for (entity e : back) {
+      mark_changed(e);
+    }
+    publish_all(on_destroy);
+    install(std::move(img));
+    publish_all(on_construct);
+  }
+
+  inline void install(image &&img) {
+    removed += back.size();
+    added += img.back.size();
+    if constexpr (mapped) {
+      data.assign(img.data.begin(), img.data.end());
+      back.assign(img.back.begin(), img.back.end());
+      forward.assign(img.forward.begin(), img.forward.end());
+    } else {
+      data = std::move(img.data);
+      back = std::move(img.back);
+      forward = std::move(img.forward);
+    }
+    refcounts.assign(back.size(), 0);
+    if constexpr (double_buffered) {
+      previous = {};
+      mirror_appended(0);
+    }
+  }
+
+  // Writes what changed since the change log was last reset: entities whose
+  // component is set (with its value) and entities whose component is gone.
+  inline void save_delta(std::ostream &os) const
+    requires snapshottable<C>
+  {
+    constexpr bool raw = !has_serializer<C>;
+    std::vector<entity> set, removed;
+    if (changes.all) {
+      set.assign(back.begin(), back.end());
+    }
+    for (entity e : changes.changed) {
+      if (!has_component(e)) {
+        removed.push_back(e);
+      } else if (!changes.all) {
+        set.push_back(e);
+      }
+    }
+
+    write_value<uint64_t>(os, type_hash<C>());
+    write_value<uint8_t>(os, raw);
+    write_block(os, set);
+    write_block(os, removed);
+    if constexpr (raw) {
+      write_value<uint64_t>(os, set.size());
+    }
+    for (entity e : set) {
+      if constexpr (raw) {
+        write_value(os, data[forward[e]]);
+      } else {
+        serializer<C>::save(os, data[forward[e]]);
+      }
+    }
+  }
+
+  struct delta_image {
+    std::vector<entity> set = {};
+    std::vector<entity> removed = {};
+    std::vector<C> values = {};
+  };
+
+  inline static std::expected<delta_image, error>
+  load_delta(std::istream &is)
+    requires snapshottable<C>
+  {
+    constexpr bool raw = !has_serializer<C>;
+    uint64_t hash = 0;
+    uint8_t stored_raw = 0;
+    if (!read_value(is, hash) || !read_value(is, stored_raw)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if (hash != type_hash<C>() || stored_raw != raw) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+
+    delta_image img;
+    if (!read_block(is, img.set) || !read_block(is, img.removed)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if constexpr (raw) {
+      if (!read_block(is, img.values)) {
+        return std::unexpected(error::snapshot_io_failed);
+      }
+    } else {
+      img.values.reserve(img.set.size());
+      for (size_t i = 0; i < img.set.size() && is; ++i) {
+        img.values.push_back(serializer<C>::load(is));
+      }
+      if (!is) {
+        return std::unexpected(error::snapshot_io_failed);
+      }
+    }
+    if (img.values.size() != img.set.size()) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    return img;
+  }
+
+  inline void apply_delta(delta_image &&img) {
+    for (entity e : img.removed) {
+      if (has_component(e)) {
+        remove_element_fast(e);
+      }
+    }
+    for (size_t i = 0; i < img.set.size(); ++i) {
+      if (has_component(img.set[i])) {
+        replace_element_fast(img.set[i], std::move(img.values[i]));
+      } else {
+        add_element_fast(img.set[i], std::move(img.values[i]));
+      }
+    }
+  }
+
+  // Read off the arrays' sizes and the counters; O(1).
+  inline pool_stats stats() const {
+    pool_stats st;
+    st.size = back.size();
+    st.data_capacity = data.capacity();
+    st.back_capacity = back.capacity();
+    st.forward_size = forward.size();
+    st.forward_capacity = forward.capacity();
+    st.data_bytes = data.capacity() * sizeof(C);
+    st.back_bytes = back.capacity() * sizeof(entity);
+    st.forward_bytes = forward.capacity() * sizeof(size_t);
+    st.refcount_bytes = refcounts.capacity() * sizeof(uint32_t);
+    st.extra_bytes = changes.changed.capacity() * sizeof(entity) +
+                     changes.stamps.capacity() * sizeof(uint32_t);
+    if constexpr (double_buffered) {
+      st.extra_bytes += previous.data.capacity() * sizeof(C) +
+                        previous.stamps.capacity() * sizeof(uint32_t) +
+                        previous.dirty.capacity() * sizeof(entity);
+    }
+    st.forward_density =
+        forward.size() == 0 ? 1.0 : double(back.size()) / forward.size();
+    st.added = added;
+    st.removed = removed;
+    st.refs = load_live_refs();
+    return st;
+  }
+
+  inline size_t load_live_refs() const {
+    if constexpr (component_traits<C>::refcount == refcount_policy::atomic) {
+      return std::atomic_ref<size_t>(const_cast<size_t &>(live_refs))
+          .load(std::memory_order_relaxed);
+    } else {
+      return live_refs;
+    }
+  }
+
+  // One pass over refcounts, skipped when the pool has no references.
+  inline ref_stats scan_refs() const {
+    ref_stats st;
+    if (load_live_refs() == 0) {
+      return st;
+    }
+    for (const uint32_t &count : refcounts) {
+      uint32_t n = count;
+      if constexpr (component_traits<C>::refcount == refcount_policy::atomic) {
+        n = std::atomic_ref<uint32_t>(const_cast<uint32_t &>(count))
+                .load(std::memory_order_relaxed);
+      }
+      st.total_refs += n;
+      st.max_refs = std::max(st.max_refs, n);
+      st.pinned += n != 0;
+    }
+    return st;
+  }
+
+  // Arrow-style columns: the owning entities, then one column per field of
+  // C, each one contiguous and 64-byte aligned. Columns that have the
+  // memory layout of the pool's arrays are written straight from them;
+  // split fields are gathered in chunks.
+  inline void save_columns(std::ostream &os) const
+    requires columnar<C>
+  {
+    using layout = column_layout<C>;
+    const uint64_t rows = back.size();
+    const columns_header h = {columns_magic, columns_version,
+                              layout::count + 1, 0, rows, type_hash<C>()};
+    write_value(os, h);
+
+    uint64_t offset = align_column(sizeof(columns_header) +
+                                   (layout::count + 1) * sizeof(column_desc));
+    auto describe = [&](uint8_t tag, uint32_t width) {
+      write_value(os, column_desc{tag, {}, width, offset, width * rows});
+      offset = align_column(offset + width * rows);
+    };
+    describe(column_tag<entity>(), sizeof(entity));
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      (describe(column_tag<typename layout::template type<I>>(),
+                sizeof(typename layout::template type<I>)),
+       ...);
+    }(std::make_index_sequence<layout::count>{});
+
+    uint64_t at = sizeof(columns_header) +
+                  (layout::count + 1) * sizeof(column_desc);
+    auto emit = [&](const void *p, uint64_t bytes) {
+      write_padding(os, at, align_column(at));
+      os.write(static_cast<const char *>(p),
+               static_cast<std::streamsize>(bytes));
+      at = align_column(at) + bytes;
+    };
+    emit(back.data(), rows * sizeof(entity));
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      (
+          [&] {
+            using F = typename layout::template type<I>;
+            if constexpr (layout::template direct<I>) {
+              emit(data.data(), rows * sizeof(F));
+            } else {
+              write_padding(os, at, align_column(at));
+              at = align_column(at) + rows * sizeof(F);
+              const size_t step = std::min<uint64_t>(rows, 4096);
+              std::vector<char> chunk(step * sizeof(F));
+              for (size_t i = 0; i < rows; i += step) {
+                const size_t n = std::min<size_t>(step, rows - i);
+                for (size_t j = 0; j < n; ++j) {
+                  std::memcpy(chunk.data() + j * sizeof(F),
+                              &layout::template field<I>(data[i + j]),
+                              sizeof(F));
+                }
+                os.write(chunk.data(),
+                         static_cast<std::streamsize>(n * sizeof(F)));
+              }
+            }
+          }(),
+          ...);
+    }(std::make_index_sequence<layout::count>{});
+  }
+
+  // Parses columns written by save_columns into an image that restore or
+  // replace can install. Direct columns are read straight into place.
+  inline static std::expected<image, error> load_columns(std::istream &is)
+    requires columnar<C>
+  {
+    using layout = column_layout<C>;
+    columns_header h = {};
+    if (!read_value(is, h)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if (h.magic != columns_magic || h.version != columns_version ||
+        h.columns != layout::count + 1 || h.type_hash != type_hash<C>()) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    std::array<column_desc, layout::count + 1> desc = {};
+    for (column_desc &d : desc) {
+      if (!read_value(is, d)) {
+        return std::unexpected(error::snapshot_io_failed);
+      }
+    }
+
+    // Columns must match C's layout and follow each other in the stream.
+    std::array<std::pair<uint8_t, uint32_t>, layout::count + 1> expected = {};
+    expected[0] = {column_tag<entity>(), sizeof(entity)};
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      ((expected[I + 1] = {column_tag<typename layout::template type<I>>(),
+                           sizeof(typename layout::template type<I>)}),
+       ...);
+    }(std::make_index_sequence<layout::count>{});
+    uint64_t at = sizeof(columns_header) + desc.size() * sizeof(column_desc);
+    for (size_t i = 0; i < desc.size(); ++i) {
+      if (desc[i].tag != expected[i].first ||
+          desc[i].width != expected[i].second || desc[i].offset < at ||
+          h.rows > std::numeric_limits<uint64_t>::max() / desc[i].width ||
+          desc[i].bytes != desc[i].width * h.rows ||
+          desc[i].offset > std::numeric_limits<uint64_t>::max() -
+                               desc[i].bytes) {
+        return std::unexpected(error::snapshot_incompatible);
+      }
+      at = desc[i].offset + desc[i].bytes;
+    }
+    if (h.rows > std::vector<C>().max_size()) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+
+    at = sizeof(columns_header) + desc.size() * sizeof(column_desc);
+    auto seek = [&](const column_desc &d) {
+      is.ignore(static_cast<std::streamsize>(d.offset - at));
+      at = d.offset + d.bytes;
+    };
+
+    // The entity column is read in bounded steps, so a row count the stream
+    // does not back fails there before the data is allocated.
+    image img;
+    seek(desc[0]);
+    if (!read_elements(is, img.back, h.rows)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    img.data.resize(h.rows);
+    bool ok = true, valid = true;
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      (
+          [&] {
+            using F = typename layout::template type<I>;
+            if (!ok) {
+              return;
+            }
+            seek(desc[I + 1]);
+            if constexpr (layout::template direct<I>) {
+              ok = static_cast<bool>(
+                  is.read(reinterpret_cast<char *>(img.data.data()),
+                          static_cast<std::streamsize>(desc[I + 1].bytes)));
+            } else {
+              const size_t step = std::min<uint64_t>(h.rows, 4096);
+              std::vector<char> chunk(step * sizeof(F));
+              for (size_t i = 0; ok && i < h.rows; i += step) {
+                const size_t n = std::min<size_t>(step, h.rows - i);
+                ok = static_cast<bool>(
+                    is.read(chunk.data(),
+                            static_cast<std::streamsize>(n * sizeof(F))));
+                for (size_t j = 0; ok && j < n; ++j) {
+                  const char *p = chunk.data() + j * sizeof(F);
+                  if constexpr (std::is_same_v<F, bool>) {
+                    valid = valid && static_cast<unsigned char>(*p) <= 1;
+                  }
+                  std::memcpy(&layout::template field<I>(img.data[i + j]), p,
+                              sizeof(F));
+                }
+              }
+            }
+          }(),
+          ...);
+    }(std::make_index_sequence<layout::count>{});
+    if (!ok) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if (!valid) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+
+    for (size_t i = 0; i < img.back.size(); ++i) {
+      const entity e = img.back[i];
+      if (e == invalid_entity) {
+        return std::unexpected(error::snapshot_incompatible);
+      }
+      if (e >= img.forward.size()) {
+        img.forward.resize(static_cast<size_t>(e) + 1,
+                           invalid_component_index);
+      }
+      if (img.forward[e] != invalid_component_index) {
+        return std::unexpected(error::snapshot_incompatible);
+      }
+      img.forward[e] = i;
+    }
+    return img;
+  }
+
+  // Binds the arrays to path.data, path.back and path.forward; see
+  // ecs::map_pool. Returns whether existing files were adopted.
+  inline std::expected<bool, error> map(const std::string &path,
+                                       bool shared_memory = false)
+    requires mapped
+  {
+    auto d = mapped_vector<C>::open(path + ".data", type_hash<C>(),
+                                    shared_memory);
+    if (!d) {
+      return std::unexpected(d.error());
+    }
+    auto b = mapped_vector<entity>::open(path + ".back", type_hash<entity>(),
+                                         shared_memory);
+    if (!b) {
+      return std::unexpected(b.error());
+    }
+    auto f = mapped_vector<size_t>::open(path + ".forward",
+                                         type_hash<size_t>(), shared_memory);
+    if (!f) {
+      return std::unexpected(f.error());
+    }
+
+    const bool adopted = !b->empty();
+    if (!adopted) {
+      d->assign(data.begin(), data.end());
+      b->assign(back.begin(), back.end());
+      f->assign(forward.begin(), forward.end());
+    } else if (d->size() != b->size() || !consistent(*b, *f)) {
+      return std::unexpected(error::snapshot_incompatible);
+    } else if (!back.empty()) {
+      return std::unexpected(error::component_already_exists);
+    }
+
+    data = std::move(*d);
+    back = std::move(*b);
+    forward = std::move(*f);
+    refcounts.assign(back.size(), 0);
+    return adopted;
+  }
+
+  inline void sync() {
+    if constexpr (mapped) {
+      data.sync();
+      back.sync();
+      forward.sync();
+    }
+  }
+
+  // The value published at the last swap_buffers.
+  inline const C &read_element(entity e) const
+    requires double_buffered
+  {
+    return previous.data[forward[e]];
+  }
+
+  inline bool has_component(entity e) const {
+    if (forward.size() == 0 || back.size() == 0 || forward.size() <= e) {
+      return false;
+    }
+
+    return forward[e] != invalid_component_index;
+  }
+};
+
+// Connects one listener to each of a pool's lifecycle signals for as long as
+// it lives. Used by the indexes that mirror a pool.
+template <typename C> struct pool_subscription {
+  using listener = typename signal<entity, C &>::listener;
+
+  inline pool_subscription(component_pool<C> &pool, listener on_construct,
+                           listener on_update, listener on_destroy)
+      : _pool(pool),
+        _on_construct(pool.on_construct.connect(std::move(on_construct))),
+        _on_update(pool.on_update.connect(std::move(on_update))),
+        _on_destroy(pool.on_destroy.connect(std::move(on_destroy))) {}
+
+  pool_subscription(const pool_subscription &) = delete;
+  pool_subscription &operator=(const pool_subscription &) = delete;
+
+  inline ~pool_subscription() {
+    _pool.on_construct.disconnect(_on_construct);
+    _pool.on_update.disconnect(_on_update);
+    _pool.on_destroy.disconnect(_on_destroy);
+  }
+
+private:
+  component_pool<C> &_pool;
+  typename signal<entity, C &>::connection _on_construct;
+  typename signal<entity, C &>::connection _on_update;
+  typename signal<entity, C &>::connection _on_destroy;
+};
+} // namespace _private
+
+// Keeps a component from being removed while it is referenced. The refcount
+// policy must match how the component's other references are made; it
+// defaults to the one in component_traits<C>.
+template <typename C, refcount_policy R = component_traits<C>::refcount>
+struct smart_ref {
+  smart_ref() : owner(invalid_entity), pool(nullptr) {}
+
+  smart_ref(_private::component_pool<C> *p, entity ent) : owner(ent), pool(p) {
+    _acquire();
+  }
+
+  ~smart_ref() {
+    if (pool && pool->has_component(owner)) {
+      _release();
+    }
+  }
+
+  smart_ref(const smart_ref &other) : owner(other.owner), pool(other.pool) {
+    if (pool && pool->has_component(owner)) {
+      _acquire();
+    }
+  }
+
+  smart_ref(smart_ref &&other) noexcept : owner(other.owner), pool(other.pool) {
+    other.pool = nullptr;
+    other.owner = invalid_entity;
+  }
+
+  smart_ref &operator=(const smart_ref &other) {
+    if (this == &other)
+      return *this;
+    this->~smart_ref();
+    pool = other.pool;
+    owner = other.owner;
+    if (pool && pool->has_component(owner)) {
+      _acquire();
+    }
+    return *this;
+  }
+
+  smart_ref &operator=(smart_ref &&other) noexcept {
+    if (this != &other) {
+      this->~smart_ref();
+      pool = other.pool;
+      owner = other.owner;
+      other.pool = nullptr;
+      other.owner = invalid_entity;
+    }
+    return *this;
+  }
+
+  bool valid() const {
+    if (!pool || !pool->has_component(owner))
+      return false;
+    return true;
+  }
+
+  C &get() {
+    assert(valid());
+    return pool->get_element_fast(owner);
+  }
+
+  void release() {
+    if (pool && pool->has_component(owner)) {
+      _release();
+    }
+    pool = nullptr;
+    owner = invalid_entity;
+  }
+
+  C *operator->() { return &get(); }
+  C &operator*() { return get(); }
+
+  entity owner = invalid_entity;
+
+private:
+  static_assert(!_private::component_pool<C>::copy_on_write ||
+                    R == refcount_policy::plain,
+                "smart_ref: copy-on-write pools need plain refcounts");
+
+  inline void _acquire() {
+    _private::acquire_ref<R>(pool->refcounts[pool->forward[owner]],
+                             pool->live_refs);
+  }
+
+  inline void _release() {
+    _private::release_ref<R>(pool->refcounts[pool->forward[owner]],
+                             pool->live_refs);
+  }
+
+  _private::component_pool<C> *pool = nullptr;
+};
+
+// Fixed set of worker threads fed from one FIFO queue. With zero threads
+// submitted work runs inline on the caller.
+struct thread_pool {
+  explicit inline thread_pool(
+      size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+    _workers.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      _workers.emplace_back([this](std::stop_token st) { _work(st); });
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  inline ~thread_pool() {
+    for (auto &w : _workers) {
+      w.request_stop();
+    }
+    _wake.notify_all();
+  }
+
+  inline void submit(std::function<void()> job) {
+    if (_workers.empty()) {
+      job();
+      return;
+    }
+    {
+      std::lock_guard lock(_mutex);
+      _jobs.push_back(std::move(job));
+    }
+    _wake.notify_one();
+  }
+
+  // Runs f(0) .. f(n - 1) on the workers and returns once all have finished.
+  // If any call throws, the first exception is rethrown here after the rest
+  // have finished.
+  template <typename F> inline void parallel_for(size_t n, F &&f) {
+    if (_workers.empty() || n <= 1) {
+      for (size_t i = 0; i < n; ++i) {
+        f(i);
+      }
+      return;
+    }
+    std::latch done(static_cast<std::ptrdiff_t>(n));
+    std::exception_ptr failure = nullptr;
+    std::once_flag first_failure;
+    for (size_t i = 0; i < n; ++i) {
+      submit([&, i] {
+        try {
+          f(i);
+        } catch (...) {
+          std::call_once(first_failure,
+                         [&] { failure = std::current_exception(); });
+        }
+        done.count_down();
+      });
+    }
+    done.wait();
+    if (failure) {
+      std::rethrow_exception(failure);
+    }
+  }
+
+  inline size_t size() const { return _workers.size(); }
+
+private:
+  inline void _work(std::stop_token st) {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock lock(_mutex);
+        if (!_wake.wait(lock, st, [this] { return !_jobs.empty(); })) {
+          return;
+        }
+        job = std::move(_jobs.front());
+        _jobs.pop_front();
+      }
+      job();
+    }
+  }
+
+  std::mutex _mutex = {};
+  std::condition_variable_any _wake = {};
+  std::deque<std::function<void()>> _jobs = {};
+  std::vector<std::jthread> _workers = {};
+};
+
+// Private, per-thread pool under construction. Workers fill one each without
+// synchronisation; ecs::merge_staged then splices them into the world.
+template <typename C> struct staging_pool {
+  std::vector<C> data = {};
+  std::vector<entity> back = {};
+
+  template <typename... Args> inline void add(entity e, Args &&...args) {
+    static_assert(std::is_constructible_v<C, Args &&...>,
+                  "add(): arguments do not match any constructor of this "
+                  "component type");
+    back.push_back(e);
+    if constexpr (sizeof...(Args) == 0) {
+      data.emplace_back();
+    } else {
+      data.emplace_back(std::forward<Args>(args)...);
+    }
+    _max_entity = std::max(_max_entity, e);
+  }
+
+  inline void reserve(size_t n) {
+    data.reserve(n);
+    back.reserve(n);
+  }
+
+  inline void clear() {
+    data.clear();
+    back.clear();
+    _max_entity = 0;
+  }
+
+  inline size_t size() const { return back.size(); }
+  inline bool empty() const { return back.empty(); }
+  inline entity max_entity() const { return _max_entity; }
+
+private:
+  entity _max_entity = 0;
+};
+
+template <typename... Cs> struct ecs {
+  template <safety_policy P>
+  using method_result_void_t =
+      std::conditional_t<P == safety_policy::unchecked, void,
+                         std::expected<void, error>>;
+
+  template <reference_style S, safety_policy P, typename C>
+  using method_result_ref_t = std::conditional_t<
+      P == safety_policy::unchecked,
+      std::conditional_t<S == reference_style::raw, C &, smart_ref<C>>,
+      std::expected<
+          std::conditional_t<S == reference_style::raw, C &, smart_ref<C>>,
+          error>>;
+
+  template <typename C, safety_policy policy = safety_policy::unchecked,
+            typename... Ts>
+  inline method_result_void_t<policy> add_component(entity e, Ts &&...ts) {
+    if constexpr (policy == safety_policy::checked) {
+      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
+          _entities.cend()) {
+        return std::unexpected(error::no_such_entity);
+      }
+    }
+
+    _private::component_pool<C> &pool =
+        std::get<_private::component_pool<C>>(_data);
+
+    if constexpr (policy == safety_policy::checked) {
+      return pool.add_element(e, std::forward<Ts>(ts)...);
+    } else {
+      pool.add_element_fast(e, std::forward<Ts>(ts)...);
+    }
+  }
+
+  template <typename C, safety_policy policy = safety_policy::unchecked>
+  inline method_result_void_t<policy> remove_component(entity e) {
+    if constexpr (policy == safety_policy::checked) {
+      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
+          _entities.cend()) {
+        return std::unexpected(error::no_such_entity);
+      }
+    }
+    _private::component_pool<C> &pool =
+        std::get<_private::component_pool<C>>(_data);
+
+    if constexpr (policy == safety_policy::checked) {
+      return pool.remove_element(e);
+    } else {
+      pool.remove_element_fast(e);
+    }
+  }
+
+  template <typename C, safety_policy policy = safety_policy::unchecked,
+            typename... Ts>
+  inline method_result_void_t<policy> replace_component(entity e, Ts &&...ts) {
+    if constexpr (policy == safety_policy::checked) {
+      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
+          _entities.cend()) {
+        return std::unexpected(error::no_such_entity);
+      }
+    }
+
+    _private::component_pool<C> &pool =
+        std::get<_private::component_pool<C>>(_data);
+
+    if constexpr (policy == safety_policy::checked) {
+      return pool.replace_element(e, std::forward<Ts>(ts)...);
+    } else {
+      pool.replace_element_fast(e, std::forward<Ts>(ts)...);
+    }
+  }
+
+  // Modifies a component in place through `f` and then notifies on_update
+  // listeners; writes made through get_component are not observed.
+  template <typename C, safety_policy policy = safety_policy::unchecked,
+            typename F>
+  inline method_result_void_t<policy> patch_component(entity e, F &&f) {
+    _private::component_pool<C> &pool =
+        std::get<_private::component_pool<C>>(_data);
+
+    if constexpr (policy == safety_policy::checked) {
+      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
+          _entities.cend()) {
+        return std::unexpected(error::no_such_entity);
+      }
+      if (!pool.has_component(e)) {
+        return std::unexpected(error::component_does_not_exist);
+      }
+      pool.patch_element_fast(e, std::forward<F>(f));
+      return {};
+    } else {
+      pool.patch_element_fast(e, std::forward<F>(f));
+    }
+  }
+
+  template <typename C, reference_style style = reference_style::raw,
+            safety_policy policy = safety_policy::unchecked>
+  [[nodiscard(
+      "Unused get_component")]] inline method_result_ref_t<style, policy, C>
+  get_component(entity e) {
+    if constexpr (policy == safety_policy::checked) {
+      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
+          _entities.cend()) {
+        return std::unexpected(error::no_such_entity);
+      }
+    }
+
+    auto &pool = std::get<_private::component_pool<C>>(_data);
+
+    if constexpr (policy == safety_policy::checked) {
+      if constexpr (style == reference_style::raw) {
+        return pool.get_element(e);
+      } else {
+        if (!pool.has_component(e))
+          return std::unexpected(error::component_does_not_exist);
+        return smart_ref<C>{&pool, e};
+      }
+    } else {
+      if constexpr (style == reference_style::raw) {
+        return pool.get_element_fast(e);
+      } else {
+        return smart_ref<C>{&pool, e};
+      }
+    }
+  }
+
+  // Reads a component without recording the access anywhere, so several
+  // threads may read the same pool at once while none of them writes it.
+  template <typename C>
+  [[nodiscard("Unused get_component")]] inline const C &
+  get_component(entity e) const {
+    return std::get<_private::component_pool<C>>(_data).get_element_fast(e);
+  }
+
+  template <typename C> bool has_component(entity e) const {
+    const _private::component_pool<C> &pool =
+        std::get<_private::component_pool<C>>(_data);
+    return pool.has_component(e);
+  }
+
+  template <remove_policy rem_policy = remove_policy::lax,
+            safety_policy saf_policy = safety_policy::unchecked,
+            typename... Ccs>
+  inline method_result_void_t<saf_policy> remove_components(entity e) {
+    if constexpr (saf_policy == safety_policy::checked) {
+      if (std::find(_entities.cbegin(), _entities.cend(), e) ==
+          _entities.cend()) {
+        return std::unexpected(error::no_such_entity);
+      }
+    }
+
+    auto checked_remove =
+        []<typename C>(_private::component_pool<C> &pool,
                        entity e) -> method_result_void_t<saf_policy> {
       if (pool.has_component(e)) {
         if constexpr (saf_policy == safety_policy::checked) {
           return pool.remove_element(e);
         } else {
-          pool.remove_element_fast(e);
+          pool.remove_element_fast(e);
+        }
+      }
+      if constexpr (saf_policy == safety_policy::checked) {
+        if constexpr (rem_policy == remove_policy::lax) {
+          return {};
+        } else {
+          return std::unexpected(error::component_does_not_exist);
+        }
+      }
+    };
+
+    if constexpr (saf_policy == safety_policy::checked) {
+      std::expected<void, error> res{};
+
+      auto try_remove = [&](auto &pool) {
+        if (!res)
+          return;
+        res = checked_remove(pool, e);
+      };
+
+      (try_remove(std::get<_private::component_pool<Ccs>>(_data)), ...);
+
+      return res;
+    } else {
+      (checked_remove(std::get<_private::component_pool<Ccs>>(_data), e), ...);
+    }
+  }
+
+  [[nodiscard]] inline entity add_entity() {
+    _entities.push_back(
+        _entity_counter.fetch_add(1, std::memory_order_relaxed));
+    if (_tracking) [[unlikely]] {
+      _created.push_back(_entities.back());
+    }
+    if (!_on_entity_create.empty()) [[unlikely]] {
+      _on_entity_create.publish(_entities.back());
+    }
+    return _entities.back();
+  }
+
+  // Removes several entities and their components, unregistering them in a
+  // single pass over the entity list. Ids that are not registered are
+  // skipped: they are neither recorded for the next delta nor published.
+  inline void remove_entities(std::span<const entity> es) {
+    for (entity e : es) {
+      remove_components<remove_policy::lax, safety_policy::unchecked, Cs...>(e);
+    }
+    std::vector<entity> sorted(es.begin(), es.end());
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<entity> erased;
+    std::erase_if(_entities.write(), [&](entity e) {
+      if (!std::binary_search(sorted.begin(), sorted.end(), e)) {
+        return false;
+      }
+      erased.push_back(e);
+      return true;
+    });
+    if (_tracking) [[unlikely]] {
+      _destroyed.insert(_destroyed.end(), erased.begin(), erased.end());
+    }
+    if (!_on_entity_destroy.empty()) [[unlikely]] {
+      for (entity e : erased) {
+        _on_entity_destroy.publish(e);
+      }
+    }
+  }
+
+  // Hands out an id without registering it; safe to call from any thread,
+  // including concurrently with add_entity. Reserved ids become entities once
+  // passed to commit_entities.
+  [[nodiscard]] inline entity reserve_entity() {
+    return _entity_counter.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Reserves n consecutive ids and returns the first one.
+  [[nodiscard]] inline entity reserve_entities(size_t n) {
+    return _entity_counter.fetch_add(static_cast<entity>(n),
+                                     std::memory_order_relaxed);
+  }
+
+  // Registers reserved ids. Not thread-safe, like every other structural
+  // change.
+  inline void commit_entities(std::span<const entity> reserved) {
+    _entities.insert(_entities.end(), reserved.begin(), reserved.end());
+    if (_tracking) [[unlikely]] {
+      _created.insert(_created.end(), reserved.begin(), reserved.end());
+    }
+    if (!_on_entity_create.empty()) [[unlikely]] {
+      for (entity e : reserved) {
+        _on_entity_create.publish(e);
+      }
+    }
+  }
+
+  template <safety_policy policy = safety_policy::unchecked>
+  inline method_result_void_t<policy> remove_entity(entity e) {
+    // Components go first: the checked removal looks the entity up again,
+    // and a component pinned by a smart_ref leaves the entity registered.
+    if constexpr (policy == safety_policy::checked) {
+      if (auto result = remove_components<remove_policy::lax,
+                                          safety_policy::checked, Cs...>(e);
+          !result) {
+        return result;
+      }
+    } else {
+      remove_components<remove_policy::lax, safety_policy::unchecked, Cs...>(e);
+    }
+
+    if (auto result = std::find(_entities.cbegin(), _entities.cend(), e);
+        result != _entities.cend()) {
+      _entities.erase(result);
+      if (_tracking) [[unlikely]] {
+        _destroyed.push_back(e);
+      }
+      if (!_on_entity_destroy.empty()) [[unlikely]] {
+        _on_entity_destroy.publish(e);
+      }
+    }
+
+    if constexpr (policy == safety_policy::checked) {
+      return {};
+    }
+  }
+
+  // Moves every staged element into the pool of C with one reservation and
+  // bulk appends, then points forward at the new slots, one stage per worker.
+  // Staged entities must not have a C yet and must be distinct across stages;
+  // the checked policy verifies that (serially) and merges nothing if not.
+  // Stages are left empty.
+  template <typename C, safety_policy policy = safety_policy::unchecked>
+  inline method_result_void_t<policy>
+  merge_staged(std::span<staging_pool<C>> stages, thread_pool &workers) {
+    _private::component_pool<C> &pool =
+        std::get<_private::component_pool<C>>(_data);
+
+    size_t total = 0;
+    entity max_entity = 0;
+    for (const auto &stage : stages) {
+      total += stage.size();
+      if (!stage.empty()) {
+        max_entity = std::max(max_entity, stage.max_entity());
+      }
+    }
+    if (total == 0) {
+      if constexpr (policy == safety_policy::checked) {
+        return {};
+      } else {
+        return;
+      }
+    }
+
+    const size_t first = pool.back.size();
+    const size_t forward_size = pool.forward.size();
+    if (max_entity >= pool.forward.size()) {
+      pool.forward.resize(static_cast<size_t>(max_entity) + 1,
+                          _private::invalid_component_index);
+    }
+
+    std::vector<size_t> bases(stages.size());
+    for (size_t i = 0, base = first; i < stages.size(); ++i) {
+      bases[i] = base;
+      base += stages[i].size();
+    }
+
+    if constexpr (policy == safety_policy::checked) {
+      // Claiming forward slots serially doubles as the duplicate check.
+      for (size_t s = 0; s < stages.size(); ++s) {
+        const auto &back = stages[s].back;
+        for (size_t i = 0; i < back.size(); ++i) {
+          size_t &slot = pool.forward[back[i]];
+          if (slot != _private::invalid_component_index) {
+            for (size_t t = 0; t <= s; ++t) {
+              const size_t n = t == s ? i : stages[t].size();
+              for (size_t j = 0; j < n; ++j) {
+                pool.forward[stages[t].back[j]] =
+                    _private::invalid_component_index;
+              }
+            }
+            return std::unexpected(error::component_already_exists);
+          }
+          slot = bases[s] + i;
+        }
+      }
+    } else {
+      // Taken once here, so a copy-on-write forward array is detached before
+      // the workers write through it.
+      size_t *forward = pool.forward.data();
+      workers.parallel_for(stages.size(), [&](size_t s) {
+        const auto &back = stages[s].back;
+        for (size_t i = 0; i < back.size(); ++i) {
+          forward[back[i]] = bases[s] + i;
+        }
+      });
+    }
+
+    pool.data.reserve(first + total);
+    pool.back.reserve(first + total);
+    for (auto &stage : stages) {
+      pool.data.insert(pool.data.end(),
+                       std::make_move_iterator(stage.data.begin()),
+                       std::make_move_iterator(stage.data.end()));
+      pool.back.insert(pool.back.end(), stage.back.begin(), stage.back.end());
+      stage.clear();
+    }
+    pool.refcounts.resize(first + total, 0);
+    pool.mirror_appended(first);
+    pool.added += total;
+    if (pool.changes.enabled || pool.undo) [[unlikely]] {
+      for (size_t i = first; i < pool.back.size(); ++i) {
+        pool.mark_changed(pool.back[i]);
+        if (pool.undo) {
+          pool.undo->added(pool.back[i], forward_size);
+        }
+      }
+    }
+
+    if (!pool.on_construct.empty()) [[unlikely]] {
+      for (size_t i = first; i < pool.back.size(); ++i) {
+        pool.on_construct.publish(pool.back[i], pool.data[i]);
+      }
+    }
+
+    if constexpr (policy == safety_policy::checked) {
+      return {};
+    }
+  }
+
+  // Publishes the current values of every double-buffered pool to readers.
+  // Call at a frame boundary, while no reader is mid-access.
+  inline void swap_buffers() {
+    (std::get<_private::component_pool<Cs>>(_data).swap_buffers(), ...);
+  }
+
+  // Reads the value published at the last swap_buffers. Safe from other
+  // threads while this one writes components, but not while it adds or
+  // removes them.
+  template <typename C> inline const C &read_component(entity e) const {
+    static_assert(component_traits<C>::double_buffered,
+                  "read_component(): component is not double-buffered");
+    return std::get<_private::component_pool<C>>(_data).read_element(e);
+  }
+
+  // Writes the whole world as a binary snapshot: a versioned header, the
+  // entity list, then every pool. Trivially copyable components are written
+  // as raw blocks; others go through serializer<C>.
+  inline std::expected<void, error> save(std::ostream &os) const {
+    static_assert((snapshottable<Cs> && ...),
+                  "save(): every component needs to be trivially copyable "
+                  "or have a serializer");
+    _private::write_value(os, snapshot_magic);
+    _private::write_value(os, snapshot_version);
+    _private::write_value<uint32_t>(os, sizeof(size_t));
+    _private::write_value<uint32_t>(os, sizeof...(Cs));
+    _private::write_value<entity>(
+        os, _entity_counter.load(std::memory_order_relaxed));
+    _private::write_value(os, _generation);
+    _private::write_block(os, _entities);
+    (std::get<_private::component_pool<Cs>>(_data).save(os), ...);
+    if (!os) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    return {};
+  }
+
+  // Replaces the world's contents with a snapshot written by save on a world
+  // of the same component types. Raw blocks are read straight into the pool
+  // arrays. Nothing is changed unless the whole snapshot is valid. There must
+  // be no outstanding smart_refs. Component listeners see every old
+  // component destroyed and every loaded one constructed; entity listeners
+  // are not notified.
+  inline std::expected<void, error> load(std::istream &is) {
+    uint32_t magic = 0, version = 0, index_width = 0, pools = 0;
+    entity counter = 0;
+    uint64_t generation = 0;
+    std::vector<entity> entities;
+    if (!_private::read_value(is, magic) ||
+        !_private::read_value(is, version) ||
+        !_private::read_value(is, index_width) ||
+        !_private::read_value(is, pools)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if (magic != snapshot_magic || version != snapshot_version ||
+        index_width != sizeof(size_t) || pools != sizeof...(Cs)) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    if (!_private::read_value(is, counter) ||
+        !_private::read_value(is, generation) ||
+        !_private::read_block(is, entities)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+
+    std::tuple<typename _private::component_pool<Cs>::image...> images;
+    std::optional<error> failure;
+    auto read = [&]<typename C>(typename _private::component_pool<C>::image
+                                    &img) {
+      if (failure) {
+        return;
+      }
+      if (auto res = _private::component_pool<C>::load(is)) {
+        img = std::move(*res);
+      } else {
+        failure = res.error();
+      }
+    };
+    (read.template operator()<Cs>(
+         std::get<typename _private::component_pool<Cs>::image>(images)),
+     ...);
+    if (failure) {
+      return std::unexpected(*failure);
+    }
+
+    (std::get<_private::component_pool<Cs>>(_data).restore(std::move(
+         std::get<typename _private::component_pool<Cs>::image>(images))),
+     ...);
+    _entities = std::move(entities);
+    _entity_counter.store(counter, std::memory_order_relaxed);
+    _generation = generation;
+    _created.clear();
+    _destroyed.clear();
+    return {};
+  }
+
+  // A copy of the world for rollback or speculation. Pools whose traits pick
+  // pool_storage::copy_on_write, and the entity list, are shared with this
+  // world until either side writes to them. Other pools are copied now. The
+  // fork has no listeners, references or change tracking, and either world
+  // may be dropped first.
+  //
+  // Sharing is per array, not per page: the first mutable get or view on a
+  // pool copies its whole data array, and the first add or remove copies its
+  // other arrays too. A pool written every frame therefore pays a full copy
+  // on its first write after each fork; forking only saves copying the pools
+  // a frame leaves untouched. Views need each array contiguous, which rules
+  // out sharing individual pages.
+  [[nodiscard]] inline ecs fork() const {
+    ecs child;
+    ((std::get<_private::component_pool<Cs>>(child._data) =
+          std::get<_private::component_pool<Cs>>(_data).fork()),
+     ...);
+    child._entities = _entities;
+    child._entity_counter.store(
+        _entity_counter.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    child._generation = _generation;
+    return child;
+  }
+
+  // Starts recording changes for save_delta, with the current state as the
+  // base. Until then nothing is recorded and the hooks cost one branch.
+  // get_component, patch_component and replace_component record single
+  // entities, and views record each element they hand out mutably; views
+  // over const components record nothing.
+  inline void track_changes() {
+    _tracking = true;
+    _created.clear();
+    _destroyed.clear();
+    auto start = [](auto &pool) {
+      pool.changes.enabled = true;
+      pool.changes.reset();
+    };
+    (start(std::get<_private::component_pool<Cs>>(_data)), ...);
+  }
+
+  // Writes the entities created and destroyed and the components added,
+  // written or removed since the last save_delta (or track_changes), then
+  // starts a new delta. Each delta names the generation it applies to and
+  // the one it produces, and full snapshots carry their generation, so a
+  // snapshot followed by its chain of deltas reproduces the world.
+  inline std::expected<void, error> save_delta(std::ostream &os) {
+    static_assert((snapshottable<Cs> && ...),
+                  "save_delta(): every component needs to be trivially "
+                  "copyable or have a serializer");
+    assert(_tracking && "save_delta(): call track_changes() first");
+    _private::write_value(os, delta_magic);
+    _private::write_value(os, delta_version);
+    _private::write_value<uint32_t>(os, sizeof...(Cs));
+    _private::write_value(os, _generation);
+    _private::write_value<uint64_t>(os, _generation + 1);
+    _private::write_value<entity>(
+        os, _entity_counter.load(std::memory_order_relaxed));
+    _private::write_block(os, _created);
+    _private::write_block(os, _destroyed);
+    (std::get<_private::component_pool<Cs>>(_data).save_delta(os), ...);
+    if (!os) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+
+    ++_generation;
+    _created.clear();
+    _destroyed.clear();
+    (std::get<_private::component_pool<Cs>>(_data).changes.reset(), ...);
+    return {};
+  }
+
+  // Applies a delta written by save_delta on a world at this world's
+  // generation. Like load, nothing changes unless the delta is valid, and
+  // there must be no outstanding smart_refs. Listeners are notified as for
+  // ordinary additions, updates and removals.
+  inline std::expected<void, error> apply_delta(std::istream &is) {
+    uint32_t magic = 0, version = 0, pools = 0;
+    uint64_t from = 0, to = 0;
+    entity counter = 0;
+    std::vector<entity> created, destroyed;
+    if (!_private::read_value(is, magic) ||
+        !_private::read_value(is, version) ||
+        !_private::read_value(is, pools) || !_private::read_value(is, from) ||
+        !_private::read_value(is, to)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+    if (magic != delta_magic || version != delta_version ||
+        pools != sizeof...(Cs) || from != _generation) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    if (!_private::read_value(is, counter) ||
+        !_private::read_block(is, created) ||
+        !_private::read_block(is, destroyed)) {
+      return std::unexpected(error::snapshot_io_failed);
+    }
+
+    std::tuple<typename _private::component_pool<Cs>::delta_image...> images;
+    std::optional<error> failure;
+    auto read = [&]<typename C>(
+                    typename _private::component_pool<C>::delta_image &img) {
+      if (failure) {
+        return;
+      }
+      if (auto res = _private::component_pool<C>::load_delta(is)) {
+        img = std::move(*res);
+      } else {
+        failure = res.error();
+      }
+    };
+    (read.template operator()<Cs>(
+         std::get<typename _private::component_pool<Cs>::delta_image>(
+             images)),
+     ...);
+    if (failure) {
+      return std::unexpected(*failure);
+    }
+
+    commit_entities(created);
+    (std::get<_private::component_pool<Cs>>(_data).apply_delta(std::move(
+         std::get<typename _private::component_pool<Cs>::delta_image>(
+             images))),
+     ...);
+    remove_entities(destroyed);
+    _entity_counter.store(
+        std::max(counter, _entity_counter.load(std::memory_order_relaxed)),
+        std::memory_order_relaxed);
+    _generation = to;
+    return {};
+  }
+
+  // Moves the arrays of C's pool (which needs pool_storage::mapped) into the
+  // files path.data, path.back and path.forward. If they already hold a pool,
+  // that pool is adopted in place of the current one, which must be empty:
+  // nothing is copied and pages are read lazily as they are touched. Its
+  // entities are registered with the world, though entities that had no
+  // mapped component are not recoverable. Adopted components are published
+  // to on_construct listeners once their entities are registered; files
+  // whose sparse set does not check out are rejected. Otherwise the files
+  // are created from the current contents. Returns whether existing files
+  // were adopted.
+  template <typename C>
+  inline std::expected<bool, error> map_pool(const std::string &path) {
+    _private::component_pool<C> &pool =
+        std::get<_private::component_pool<C>>(_data);
+    auto adopted = pool.map(path);
+    if (!adopted || !*adopted) {
+      return adopted;
+    }
+
+    std::unordered_set<entity> known(_entities.cbegin(), _entities.cend());
+    entity next = _entity_counter.load(std::memory_order_relaxed);
+    for (entity e : pool.back) {
+      if (known.insert(e).second) {
+        _entities.push_back(e);
+      }
+      next = std::max(next, e + 1);
+    }
+    _entity_counter.store(next, std::memory_order_relaxed);
+    pool.added += pool.back.size();
+    pool.publish_all(pool.on_construct);
+    return true;
+  }
+
+  // Memory use and counters of every pool, cheap enough to export each
+  // frame; see pool_stats.
+  inline world_stats<sizeof...(Cs)> stats() const {
+    world_stats<sizeof...(Cs)> st;
+    st.entities = _entities.size();
+    st.entity_bytes = _entities.capacity() * sizeof(entity);
+    st.next_entity = _entity_counter.load(std::memory_order_relaxed);
+    size_t i = 0;
+    ((st.pools[i++] = std::get<_private::component_pool<Cs>>(_data).stats()),
+     ...);
+    return st;
+  }
+
+  template <typename C> inline pool_stats stats() const {
+    return std::get<_private::component_pool<C>>(_data).stats();
+  }
+
+  // Reference counts of pool C, including the most held on one component
+  // and how many components are pinned. Unlike stats, which carries the
+  // running total, this walks every component's refcount, so it is meant for
+  // debugging leaked smart_refs rather than for per-frame export.
+  template <typename C> inline ref_stats scan_refs() const {
+    return std::get<_private::component_pool<C>>(_data).scan_refs();
+  }
+
+  // Restarts the add/remove counters of every pool.
+  inline void reset_stats() {
+    auto reset = [](auto &pool) { pool.added = pool.removed = 0; };
+    (reset(std::get<_private::component_pool<Cs>>(_data)), ...);
+  }
+
+  // Flushes every file-backed pool to disk.
+  inline void sync_pools() {
+    (std::get<_private::component_pool<Cs>>(_data).sync(), ...);
+  }
+
+  // Writes pool C as Arrow-style columns: its entities, then one column per
+  // field of C. Meant for analytics dumps; read back with import_columns.
+  template <typename C>
+    requires columnar<C>
+  inline void export_columns(std::ostream &os) const {
+    std::get<_private::component_pool<C>>(_data).save_columns(os);
+  }
+
+  // Replaces pool C's contents with columns written by export_columns,
+  // registering entities this world does not know yet. Nothing changes
+  // unless the whole file is valid. There must be no outstanding smart_refs
+  // into the pool. Listeners see the old components destroyed and the
+  // imported ones constructed, after the new entities are registered.
+  template <typename C>
+    requires columnar<C>
+  inline std::expected<void, error> import_columns(std::istream &is) {
+    auto img = _private::component_pool<C>::load_columns(is);
+    if (!img) {
+      return std::unexpected(img.error());
+    }
+    std::unordered_set<entity> known(_entities.cbegin(), _entities.cend());
+    std::vector<entity> unknown;
+    for (entity e : img->back) {
+      if (!known.contains(e)) {
+        unknown.push_back(e);
+      }
+    }
+    _adopt_entities(unknown);
+    std::get<_private::component_pool<C>>(_data).replace(std::move(*img));
+    return {};
+  }
+
+  // Fired after an entity is registered and after it is unregistered (its
+  // components are gone by then).
+  signal<entity> &on_entity_create() { return _on_entity_create; }
+  signal<entity> &on_entity_destroy() { return _on_entity_destroy; }
+
+  template <typename C> signal<entity, C &> &on_construct() {
+    return std::get<_private::component_pool<C>>(_data).on_construct;
+  }
+
+  template <typename C> signal<entity, C &> &on_update() {
+    return std::get<_private::component_pool<C>>(_data).on_update;
+  }
+
+  template <typename C> signal<entity, C &> &on_destroy() {
+    return std::get<_private::component_pool<C>>(_data).on_destroy;
+  }
+
+  template <typename C> _private::component_pool<C> &pool_of() {
+    return std::get<_private::component_pool<C>>(_data);
+  }
+
+  template <typename C> const _private::component_pool<C> &pool_of() const {
+    return std::get<_private::component_pool<C>>(_data);
+  }
+
+private:
+  std::tuple<_private::component_pool<Cs>...> _data = {};
+  // Shared with forks until either side changes it.
+  _private::cow_vector<entity> _entities = {};
+  _private::copyable_atomic<entity> _entity_counter = 0;
+
+  // Change tracking for deltas.
+  uint64_t _generation = 0;
+  bool _tracking = false;
+  std::vector<entity> _created = {};
+  std::vector<entity> _destroyed = {};
+
+  signal<entity> _on_entity_create = {};
+  signal<entity> _on_entity_destroy = {};
+
+  // Registers ids handed out by another world, moving the id counter past
+  // them so local ids never collide.
+  inline void _adopt_entities(std::span<const entity> es) {
+    entity next = _entity_counter.load(std::memory_order_relaxed);
+    for (entity e : es) {
+      next = std::max(next, e + 1);
+    }
+    _entity_counter.store(next, std::memory_order_relaxed);
+    commit_entities(es);
+  }
+
+  template <typename... Ccs> friend struct view;
+  template <typename... Ccs> friend struct change_applier;
+  template <typename... Ccs> friend struct world_history;
+  template <typename... Ccs> friend struct shm_writer;
+};
+
+// Views over const-qualified components (view<const A, B>) hand those out as
+// const references and record nothing for them. Mutable components are
+// marked written, element by element, as the view hands them out.
+template <typename... Ccs> struct view {
+  inline constexpr static bool enable_borrowed_range = true; // potentially
+                                                             // dangerous
+  template <typename C>
+  using pool_type = _private::component_pool<std::remove_const_t<C>>;
+
+  view() = delete;
+  template <typename... Cs>
+  inline view(ecs<Cs...> &c,
+              size_t prefetch_distance = default_prefetch_distance)
+      : _pools({&std::get<pool_type<Ccs>>(c._data)...}),
+        _driver(_smallest_pool()), _prefetch_distance(prefetch_distance) {}
+
+  // end() is a sentinel: iteration stops when the cursor reaches the end of
+  // the driving pool, which the iterator already carries.
+  struct sentinel {};
+
+  // The iterator copies the raw arrays it needs out of the pools when it is
+  // created, so the loop never goes back through the view or the pools.
+  // Structural changes to any of the pools invalidate it.
+  struct iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::pair<entity, std::tuple<Ccs &...>>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = value_type;
+
+    iterator() = default;
+    inline iterator(const view<Ccs...> &view)
+        : _lookups(_make_lookups(view, std::index_sequence_for<Ccs...>{})),
+          _driver(view._driver), _prefetch_distance(view._prefetch_distance) {
+      const std::span<const entity> back = _driver_back(
+          view, std::make_index_sequence<sizeof...(Ccs)>{});
+      _cursor = back.data();
+      _last = back.data() + back.size();
+      _skip_non_matching();
+    }
+
+    inline iterator &operator++() {
+      ++_cursor;
+      _skip_non_matching();
+      return *this;
+    }
+
+    inline iterator operator++(int) {
+      iterator tmp = *this;
+      ++*this;
+      return tmp;
+    }
+
+    inline bool operator==(const iterator &other) const {
+      return _cursor == other._cursor;
+    }
+
+    inline bool operator==(sentinel) const { return _cursor == _last; }
+
+    inline std::pair<entity, std::tuple<Ccs &...>> operator*() const {
+      const entity e = *_cursor;
+      assert(_has_all(e) == true);
+      return {e, _get_components(e, std::index_sequence_for<Ccs...>{})};
+    }
+
+  private:
+    template <typename C> struct lookup {
+      const size_t *forward = nullptr;
+      size_t forward_size = 0;
+      C *data = nullptr;
+      // Set when writes to the pool are recorded, see component_pool::touch.
+      [[no_unique_address]] std::conditional_t<std::is_const_v<C>,
+                                               _private::no_read_buffer,
+                                               pool_type<C> *>
+          tracked = {};
+
+      inline bool contains(entity e) const {
+        return e < forward_size &&
+               forward[e] != _private::invalid_component_index;
+      }
+
+      inline C &get(entity e) const {
+        const size_t idx = forward[e];
+        if constexpr (!std::is_const_v<C>) {
+          if (tracked) [[unlikely]] {
+            tracked->touch(idx);
+          }
+        }
+        return data[idx];
+      }
+    };
+
+    template <std::size_t... I>
+    static std::tuple<lookup<Ccs>...>
+    _make_lookups(const view<Ccs...> &v, std::index_sequence<I...>) {
+      auto make = [&]<typename C>(pool_type<C> *pool) {
+        const auto &forward = std::as_const(pool->forward);
+        lookup<C> l{forward.data(), forward.size()};
+        if constexpr (std::is_const_v<C>) {
+          l.data = std::as_const(pool->data).data();
+        } else {
+          l.data = pool->data.data();
+          l.tracked = pool->tracks_writes() ? pool : nullptr;
+        }
+        return l;
+      };
+      return {make.template operator()<Ccs>(std::get<I>(v._pools))...};
+    }
+
+    // Read through the storage's const accessors, whichever array type the
+    // driving pool keeps back in.
+    template <std::size_t... I>
+    static std::span<const entity>
+    _driver_back(const view<Ccs...> &v, std::index_sequence<I...>) {
+      std::span<const entity> res;
+      auto one = [&](const auto &back) {
+        res = std::span<const entity>(back.data(), back.size());
+      };
+      ((I == v._driver ? one(std::as_const(std::get<I>(v._pools)->back))
+                       : void()),
+       ...);
+      return res;
+    }
+
+    inline void _skip_non_matching() {
+      while (_cursor != _last) {
+        if constexpr (sizeof...(Ccs) > 1) {
+          _prefetch_ahead();
+        }
+        if (_has_all(*_cursor)) {
+          break;
+        }
+        ++_cursor;
+      }
+    }
+
+    // Two-stage software pipeline: the forward slot of the entity 2d ahead is
+    // requested first, so by the time the cursor is d ahead of an element its
+    // forward entry is cached and the component itself can be requested
+    // without stalling on the dependent load.
+    inline void _prefetch_ahead() const {
+      const size_t d = _prefetch_distance;
+      if (d == 0) {
+        return;
+      }
+      const size_t remaining = static_cast<size_t>(_last - _cursor);
+      if (2 * d < remaining) {
+        _prefetch_forward(_cursor[2 * d], std::index_sequence_for<Ccs...>{});
+      }
+      if (d < remaining) {
+        _prefetch_data(_cursor[d], std::index_sequence_for<Ccs...>{});
+      }
+    }
+
+    template <std::size_t... I>
+    inline void _prefetch_forward(entity e, std::index_sequence<I...>) const {
+      auto one = [&](const auto &l) {
+        if (e < l.forward_size) {
+          _private::prefetch(l.forward + e);
+        }
+      };
+      (one(std::get<I>(_lookups)), ...);
+    }
+
+    template <std::size_t... I>
+    inline void _prefetch_data(entity e, std::index_sequence<I...>) const {
+      auto one = [&](size_t i, const auto &l) {
+        if (i != _driver && l.contains(e)) {
+          _private::prefetch(l.data + l.forward[e]);
+        }
+      };
+      (one(I, std::get<I>(_lookups)), ...);
+    }
+
+    // The driving pool contains every entity the cursor visits.
+    bool _has_all(entity e) const {
+      return _has_all_impl(e, std::index_sequence_for<Ccs...>{});
+    }
+
+    template <std::size_t... I>
+    bool _has_all_impl(entity e, std::index_sequence<I...>) const {
+      return (... && (I == _driver || std::get<I>(_lookups).contains(e)));
+    }
+
+    template <std::size_t... I>
+    std::tuple<Ccs &...> _get_components(entity e,
+                                         std::index_sequence<I...>) const {
+      return std::forward_as_tuple(std::get<I>(_lookups).get(e)...);
+    }
+
+    const entity *_cursor = nullptr;
+    const entity *_last = nullptr;
+    std::tuple<lookup<Ccs>...> _lookups = {};
+    size_t _driver = 0;
+    size_t _prefetch_distance = 0;
+  };
+
+  inline iterator begin() const { return iterator(*this); }
+  inline sentinel end() const { return {}; }
+
+private:
+  // Index into Ccs of the pool with the fewest elements; it drives iteration.
+  size_t _smallest_pool() const {
+    return _smallest_pool_impl(std::index_sequence_for<Ccs...>{});
+  }
+
+  template <size_t... Is>
+  size_t _smallest_pool_impl(std::index_sequence<Is...>) const {
+    constexpr size_t N = sizeof...(Is);
+    const size_t sizes[N] = {std::get<Is>(_pools)->back.size()...};
+
+    size_t res = 0;
+    for (size_t i = 1; i < N; ++i) {
+      if (sizes[i] < sizes[res]) {
+        res = i;
+      }
+    }
+    return res;
+  }
+
+  std::tuple<pool_type<Ccs> *...> _pools;
+  size_t _driver;
+  size_t _prefetch_distance = default_prefetch_distance;
+};
+
+// A single pool needs no membership tests: index i of `back` is index i of
+// `data` by construction, so both arrays are walked directly and are also
+// exposed as contiguous spans.
+template <typename C> struct view<C> {
+  inline constexpr static bool enable_borrowed_range = true; // potentially
+                                                             // dangerous
+  using pool_type = _private::component_pool<std::remove_const_t<C>>;
+
+  view() = delete;
+  template <typename... Cs>
+  inline view(ecs<Cs...> &c, size_t = default_prefetch_distance)
+      : _pool(std::get<pool_type>(c._data)) {}
+
+  struct iterator {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::pair<entity, std::tuple<C &>>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = value_type;
+    iterator() = default;
+    inline iterator(const entity *e, C *c, pool_type *tracked = nullptr)
+        : _entity(e), _component(c), _tracked(tracked) {}
+
+    inline iterator &operator++() {
+      ++_entity;
+      ++_component;
+      return *this;
+    }
+
+    inline iterator operator++(int) {
+      iterator tmp = *this;
+      ++*this;
+      return tmp;
+    }
+
+    inline bool operator!=(const iterator &other) const {
+      return _entity != other._entity;
+    }
+
+    inline bool operator==(const iterator &other) const {
+      return _entity == other._entity;
+    }
+
+    inline std::pair<entity, std::tuple<C &>> operator*() const {
+      if constexpr (!std::is_const_v<C>) {
+        if (_tracked) [[unlikely]] {
+          _tracked->touch(static_cast<size_t>(
+              _component - std::as_const(_tracked->data).data()));
+        }
+      }
+      return {*_entity, std::tuple<C &>(*_component)};
+    }
+
+  private:
+    const entity *_entity = nullptr;
+    C *_component = nullptr;
+    pool_type *_tracked = nullptr;
+  };
+
+  // Only data is handed out mutably; back is read through const access so a
+  // copy-on-write pool keeps sharing it.
+  inline iterator begin() {
+    pool_type *tracked = nullptr;
+    if constexpr (!std::is_const_v<C>) {
+      tracked = _pool.tracks_writes() ? &_pool : nullptr;
+    }
+    return iterator(std::as_const(_pool.back).data(), _data(), tracked);
+  }
+  inline iterator end() {
+    const auto &back = std::as_const(_pool.back);
+    return iterator(back.data() + back.size(), _data() + back.size());
+  }
+
+  inline size_t size() const { return _pool.back.size(); }
+  inline bool empty() const { return _pool.back.empty(); }
+
+  inline std::span<const entity> entities() const {
+    return std::as_const(_pool.back);
+  }
+  // The span can be written anywhere, so a mutable one marks the whole pool.
+  inline std::span<C> components() {
+    if constexpr (!std::is_const_v<C>) {
+      _pool.touch_all();
+    }
+    return std::span<C>(_data(), std::as_const(_pool.data).size());
+  }
+
+private:
+  inline C *_data() const {
+    if constexpr (std::is_const_v<C>) {
+      return std::as_const(_pool.data).data();
+    } else {
+      return _pool.data.data();
+    }
+  }
+
+  pool_type &_pool;
+};
+
+// Reads the position out of a component that has x, y and z members.
+template <typename C> struct default_position {
+  inline std::array<float, 3> operator()(const C &c) const {
+    return {static_cast<float>(c.x), static_cast<float>(c.y),
+            static_cast<float>(c.z)};
+  }
+};
+
+// Uniform hashed grid over a position component. It subscribes to the pool's
+// signals, so adds, removes, replace_component and patch_component keep it
+// current; positions written through get_component or a view are not seen
+// until update() is called for that entity.
+template <typename C, typename Position = default_position<C>>
+struct spatial_grid {
+  using vec3 = std::array<float, 3>;
+  using value_type = std::pair<entity, std::tuple<C &>>;
+
+  spatial_grid() = delete;
+  template <typename... Cs>
+  inline spatial_grid(ecs<Cs...> &world, float cell_size,
+                      Position position = {})
+      : _pool(world.template pool_of<C>()), _position(std::move(position)),
+        _inv_cell(1.0f / cell_size),
+        _subscription(
+            _pool, [this](entity e, C &c) { _insert(e, _cell_of(c)); },
+            [this](entity e, C &c) { _move(e, c); },
+            [this](entity e, C &) { _erase(e); }) {
+    assert(cell_size > 0.0f);
+    for (size_t i = 0; i < _pool.back.size(); ++i) {
+      _insert(_pool.back[i], _cell_of(_pool.data[i]));
+    }
+  }
+
+  // Re-bins an entity whose position was written without notification.
+  inline void update(entity e) {
+    if (_pool.has_component(e)) {
+      _move(e, _pool.get_element_fast(e));
+    }
+  }
+
+  template <typename F> inline void for_each_in_box(vec3 lo, vec3 hi, F &&f) {
+    _for_each_candidate(lo, hi, [&](entity e, C &c) {
+      const vec3 p = _position(c);
+      if (p[0] >= lo[0] && p[0] <= hi[0] && p[1] >= lo[1] && p[1] <= hi[1] &&
+          p[2] >= lo[2] && p[2] <= hi[2]) {
+        f(e, c);
+      }
+    });
+  }
+
+  template <typename F>
+  inline void for_each_in_radius(vec3 center, float radius, F &&f) {
+    const float r2 = radius * radius;
+    const vec3 lo{center[0] - radius, center[1] - radius, center[2] - radius};
+    const vec3 hi{center[0] + radius, center[1] + radius, center[2] + radius};
+    _for_each_candidate(lo, hi, [&](entity e, C &c) {
+      const vec3 p = _position(c);
+      const float dx = p[0] - center[0];
+      const float dy = p[1] - center[1];
+      const float dz = p[2] - center[2];
+      if (dx * dx + dy * dy + dz * dz <= r2) {
+        f(e, c);
+      }
+    });
+  }
+
+  inline std::vector<value_type> query_box(vec3 lo, vec3 hi) {
+    std::vector<value_type> res;
+    for_each_in_box(lo, hi, [&](entity e, C &c) {
+      res.emplace_back(e, std::tuple<C &>(c));
+    });
+    return res;
+  }
+
+  inline std::vector<value_type> query_radius(vec3 center, float radius) {
+    std::vector<value_type> res;
+    for_each_in_radius(center, radius, [&](entity e, C &c) {
+      res.emplace_back(e, std::tuple<C &>(c));
+    });
+    return res;
+  }
+
+  inline size_t size() const { return _size; }
+
+private:
+  using cell_key = uint64_t;
+  // Cell coordinates are packed 21 bits per axis; queries spanning more
+  // cells than that fall back to visiting every occupied cell.
+  constexpr static int64_t _axis_cells = int64_t{1} << 21;
+  constexpr static uint32_t _invalid_slot =
+      std::numeric_limits<uint32_t>::max();
+
+  struct slot {
+    cell_key cell = 0;
+    uint32_t index = _invalid_slot;
+  };
+
+  inline std::array<int64_t, 3> _coords(const vec3 &p) const {
+    return {static_cast<int64_t>(std::floor(p[0] * _inv_cell)),
+            static_cast<int64_t>(std::floor(p[1] * _inv_cell)),
+            static_cast<int64_t>(std::floor(p[2] * _inv_cell))};
+  }
+
+  static inline cell_key _key(int64_t x, int64_t y, int64_t z) {
+    constexpr uint64_t mask = _axis_cells - 1;
+    return (static_cast<uint64_t>(x) & mask) << 42 |
+           (static_cast<uint64_t>(y) & mask) << 21 |
+           (static_cast<uint64_t>(z) & mask);
+  }
+
+  inline cell_key _cell_of(const C &c) const {
+    const auto [x, y, z] = _coords(_position(c));
+    return _key(x, y, z);
+  }
+
+  inline void _insert(entity e, cell_key cell) {
+    if (e >= _slots.size()) {
+      _slots.resize(e + 1);
+    }
+    std::vector<entity> &members = _cells[cell];
+    _slots[e] = {cell, static_cast<uint32_t>(members.size())};
+    members.push_back(e);
+    ++_size;
+  }
+
+  inline void _erase(entity e) {
+    slot &s = _slots[e];
+    assert(s.index != _invalid_slot);
+    auto it = _cells.find(s.cell);
+    std::vector<entity> &members = it->second;
+    const entity moved = members.back();
+    members[s.index] = moved;
+    _slots[moved].index = s.index;
+    members.pop_back();
+    if (members.empty()) {
+      _cells.erase(it);
+    }
+    s.index = _invalid_slot;
+    --_size;
+  }
+
+  inline void _move(entity e, const C &c) {
+    const cell_key cell = _cell_of(c);
+    if (_slots[e].cell != cell) {
+      _erase(e);
+      _insert(e, cell);
+    }
+  }
+
+  template <typename F>
+  inline void _for_each_candidate(const vec3 &lo, const vec3 &hi, F &&f) {
+    const auto a = _coords(lo);
+    const auto b = _coords(hi);
+    const int64_t nx = b[0] - a[0] + 1, ny = b[1] - a[1] + 1,
+                  nz = b[2] - a[2] + 1;
+
+    auto visit = [&](const std::vector<entity> &members) {
+      for (entity e : members) {
+        f(e, _pool.get_element_fast(e));
+      }
+    };
+
+    if (nx >= _axis_cells || ny >= _axis_cells || nz >= _axis_cells ||
+        static_cast<double>(nx) * ny * nz >
+            static_cast<double>(_cells.size())) {
+      for (const auto &[_, members] : _cells) {
+        visit(members);
+      }
+      return;
+    }
+
+    for (int64_t x = a[0]; x <= b[0]; ++x) {
+      for (int64_t y = a[1]; y <= b[1]; ++y) {
+        for (int64_t z = a[2]; z <= b[2]; ++z) {
+          if (auto it = _cells.find(_key(x, y, z)); it != _cells.end()) {
+            visit(it->second);
+          }
+        }
+      }
+    }
+  }
+
+  _private::component_pool<C> &_pool;
+  Position _position;
+  float _inv_cell;
+  std::unordered_map<cell_key, std::vector<entity>> _cells = {};
+  std::vector<slot> _slots = {};
+  size_t _size = 0;
+  _private::pool_subscription<C> _subscription;
+};
+
+// Secondary indexes map a projection of a component (a team id, an asset
+// handle, ...) to the entities holding it. Like spatial_grid they follow the
+// pool through its signals; since they store entities rather than dense
+// indices, remove_element_fast's swap-and-pop never invalidates them. Values
+// changed without replace_component / patch_component need update(e).
+template <typename C, typename Proj>
+using index_key_t =
+    std::remove_cvref_t<std::invoke_result_t<const Proj &, const C &>>;
+
+// Equality lookups; find() returns the entities whose key compares equal.
+template <typename C, typename Proj> struct hash_index {
+  using key_type = index_key_t<C, Proj>;
+
+  hash_index() = delete;
+  template <typename... Cs>
+  inline hash_index(ecs<Cs...> &world, Proj proj = {})
+      : _pool(world.template pool_of<C>()), _proj(std::move(proj)),
+        _subscription(
+            _pool, [this](entity e, C &c) { _insert(e, _proj(c)); },
+            [this](entity e, C &c) { _move(e, c); },
+            [this](entity e, C &) { _erase(e); }) {
+    for (size_t i = 0; i < _pool.back.size(); ++i) {
+      _insert(_pool.back[i], _proj(_pool.data[i]));
+    }
+  }
+
+  inline void update(entity e) {
+    if (_pool.has_component(e)) {
+      _move(e, _pool.get_element_fast(e));
+    }
+  }
+
+  inline std::span<const entity> find(const key_type &key) const {
+    if (auto it = _buckets.find(key); it != _buckets.end()) {
+      return it->second;
+    }
+    return {};
+  }
+
+  inline size_t count(const key_type &key) const { return find(key).size(); }
+
+  inline bool contains(const key_type &key) const {
+    return _buckets.contains(key);
+  }
+
+private:
+  struct slot {
+    key_type key;
+    size_t index;
+  };
+
+  inline void _insert(entity e, key_type key) {
+    if (e >= _slots.size()) {
+      _slots.resize(e + 1);
+    }
+    std::vector<entity> &members = _buckets[key];
+    _slots[e].emplace(slot{std::move(key), members.size()});
+    members.push_back(e);
+  }
+
+  inline void _erase(entity e) {
+    assert(e < _slots.size() && _slots[e].has_value());
+    slot &s = *_slots[e];
+    auto it = _buckets.find(s.key);
+    std::vector<entity> &members = it->second;
+    const entity moved = members.back();
+    members[s.index] = moved;
+    _slots[moved]->index = s.index;
+    members.pop_back();
+    if (members.empty()) {
+      _buckets.erase(it);
+    }
+    _slots[e].reset();
+  }
+
+  inline void _move(entity e, const C &c) {
+    key_type key = _proj(c);
+    if (!(_slots[e]->key == key)) {
+      _erase(e);
+      _insert(e, std::move(key));
+    }
+  }
+
+  _private::component_pool<C> &_pool;
+  Proj _proj;
+  std::unordered_map<key_type, std::vector<entity>> _buckets = {};
+  std::vector<std::optional<slot>> _slots = {};
+  _private::pool_subscription<C> _subscription;
+};
+
+// Range lookups over an ordered key; range(lo, hi) is inclusive on both ends
+// and yields entities in key order.
+template <typename C, typename Proj> struct ordered_index {
+  using key_type = index_key_t<C, Proj>;
+
+  ordered_index() = delete;
+  template <typename... Cs>
+  inline ordered_index(ecs<Cs...> &world, Proj proj = {})
+      : _pool(world.template pool_of<C>()), _proj(std::move(proj)),
+        _subscription(
+            _pool, [this](entity e, C &c) { _insert(e, _proj(c)); },
+            [this](entity e, C &c) { _move(e, c); },
+            [this](entity e, C &) { _erase(e); }) {
+    for (size_t i = 0; i < _pool.back.size(); ++i) {
+      _insert(_pool.back[i], _proj(_pool.data[i]));
+    }
+  }
+
+  inline void update(entity e) {
+    if (_pool.has_component(e)) {
+      _move(e, _pool.get_element_fast(e));
+    }
+  }
+
+  inline auto equal_range(const key_type &key) const {
+    auto [lo, hi] = _entries.equal_range(key);
+    return std::ranges::subrange(lo, hi) | std::views::values;
+  }
+
+  inline auto range(const key_type &lo, const key_type &hi) const {
+    return std::ranges::subrange(_entries.lower_bound(lo),
+                                 _entries.upper_bound(hi)) |
+           std::views::values;
+  }
+
+  inline size_t size() const { return _entries.size(); }
+
+private:
+  using map_type = std::multimap<key_type, entity>;
+
+  inline void _insert(entity e, key_type key) {
+    if (e >= _slots.size()) {
+      _slots.resize(e + 1, _entries.end());
+    }
+    _slots[e] = _entries.emplace(std::move(key), e);
+  }
+
+  inline void _erase(entity e) {
+    assert(e < _slots.size() && _slots[e] != _entries.end());
+    _entries.erase(_slots[e]);
+    _slots[e] = _entries.end();
+  }
+
+  inline void _move(entity e, const C &c) {
+    key_type key = _proj(c);
+    if (!(_slots[e]->first == key)) {
+      _erase(e);
+      _insert(e, std::move(key));
+    }
+  }
+
+  _private::component_pool<C> &_pool;
+  Proj _proj;
+  map_type _entries = {};
+  std::vector<typename map_type::iterator> _slots = {};
+  _private::pool_subscription<C> _subscription;
+};
+
+// Access declarations for systems: reads<A, B> may look at A and B,
+// writes<C> may also modify C.
+template <typename... Cs> struct reads {};
+template <typename... Cs> struct writes {};
+
+namespace _private {
+template <typename T, typename... Ts>
+constexpr bool contains_v = (std::is_same_v<T, Ts> || ...);
+
+template <typename Access> struct access_traits;
+template <typename... Cs> struct access_traits<reads<Cs...>> {
+  template <typename C> constexpr static bool reads = contains_v<C, Cs...>;
+  template <typename C> constexpr static bool writes = false;
+  template <typename... Ws>
+  constexpr static bool within = (contains_v<Cs, Ws...> && ...);
+};
+template <typename... Cs> struct access_traits<writes<Cs...>> {
+  template <typename C> constexpr static bool reads = contains_v<C, Cs...>;
+  template <typename C> constexpr static bool writes = contains_v<C, Cs...>;
+  template <typename... Ws>
+  constexpr static bool within = (contains_v<Cs, Ws...> && ...);
+};
+} // namespace _private
+
+// What a system gets to touch the world with. Every accessor checks at
+// compile time that the component was declared. Components a system only
+// reads come out of its views as const, and neither those views nor read()
+// and has() record anything, so systems reading the same pool can run at
+// once.
+template <typename World, typename... Access> struct system_context {
+  template <typename C>
+  constexpr static bool can_read =
+      (_private::access_traits<Access>::template reads<C> || ...);
+  template <typename C>
+  constexpr static bool can_write =
+      (_private::access_traits<Access>::template writes<C> || ...);
+
+  template <typename C>
+  using view_component =
+      std::conditional_t<can_write<C>, C, const std::remove_const_t<C>>;
+
+  explicit inline system_context(World &world) : _world(world) {}
+
+  template <typename... Ccs>
+  inline mm::ecs::view<view_component<Ccs>...> view() {
+    static_assert((can_read<std::remove_const_t<Ccs>> && ...),
+                  "view(): system did not declare access to every component");
+    return mm::ecs::view<view_component<Ccs>...>(_world);
+  }
+
+  template <typename C> inline const C &read(entity e) {
+    static_assert(can_read<C>, "read(): component not declared by system");
+    return std::as_const(_world).template get_component<C>(e);
+  }
+
+  template <typename C> inline C &write(entity e) {
+    static_assert(can_write<C>, "write(): component not declared writable");
+    return _world.template get_component<C>(e);
+  }
+
+  template <typename C> inline bool has(entity e) {
+    static_assert(can_read<C>, "has(): component not declared by system");
+    return std::as_const(_world).template has_component<C>(e);
+  }
+
+private:
+  World &_world;
+};
+
+// Runs registered systems once per run() call. Systems conflict when they
+// share a component and at least one of them writes it; conflicting systems
+// keep their registration order, everything else runs concurrently on the
+// thread pool. Structural changes from inside systems must go through a
+// deferred path, since other systems may be iterating the same pools.
+template <typename... Cs> struct system_scheduler {
+  using world_type = ecs<Cs...>;
+
+  inline system_scheduler(world_type &world, thread_pool &pool)
+      : _world(world), _pool(pool) {}
+
+  template <typename... Access, typename F> inline void add_system(F &&f) {
+    static_assert(
+        (_private::access_traits<Access>::template within<Cs...> && ...),
+        "add_system(): declared component is not part of this ecs");
+    using context = system_context<world_type, Access...>;
+    static_assert(std::is_invocable_v<F &, context &>,
+                  "add_system(): system must accept its system_context");
+
+    system s;
+    s.run = [this, f = std::forward<F>(f)]() mutable {
+      context ctx(_world);
+      f(ctx);
+    };
+    s.reads = {(context::template can_read<Cs>)...};
+    s.writes = {(context::template can_write<Cs>)...};
+    _systems.push_back(std::move(s));
+    _graph_dirty = true;
+  }
+
+  inline size_t size() const { return _systems.size(); }
+
+  // Runs every system once and returns when all of them have finished.
+  inline void run() {
+    if (_graph_dirty) {
+      _build_graph();
+    }
+    if (_systems.empty()) {
+      return;
+    }
+
+    std::vector<std::atomic<size_t>> waiting(_systems.size());
+    for (size_t i = 0; i < _systems.size(); ++i) {
+      waiting[i].store(_systems[i].dependencies, std::memory_order_relaxed);
+    }
+    size_t pending = _systems.size();
+    std::mutex done_mutex;
+    std::condition_variable done;
+    std::exception_ptr failure = nullptr;
+
+    std::function<void(size_t)> launch = [&](size_t i) {
+      _pool.submit([&, i] {
+        try {
+          _systems[i].run();
+        } catch (...) {
+          std::lock_guard lock(done_mutex);
+          if (!failure) {
+            failure = std::current_exception();
+          }
+        }
+        for (size_t next : _systems[i].successors) {
+          if (waiting[next].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            launch(next);
+          }
+        }
+        // Decremented under the lock so run() cannot return, and destroy
+        // these locals, between the last decrement and the notify.
+        std::lock_guard lock(done_mutex);
+        if (--pending == 0) {
+          done.notify_all();
+        }
+      });
+    };
+
+    for (size_t i = 0; i < _systems.size(); ++i) {
+      if (_systems[i].dependencies == 0) {
+        launch(i);
+      }
+    }
+
+    std::unique_lock lock(done_mutex);
+    done.wait(lock, [&] { return pending == 0; });
+    if (failure) {
+      std::rethrow_exception(failure);
+    }
+  }
+
+private:
+  struct system {
+    std::function<void()> run = {};
+    std::array<bool, sizeof...(Cs)> reads = {};
+    std::array<bool, sizeof...(Cs)> writes = {};
+    std::vector<size_t> successors = {};
+    size_t dependencies = 0;
+  };
+
+  inline static bool _conflict(const system &a, const system &b) {
+    for (size_t c = 0; c < sizeof...(Cs); ++c) {
+      if ((a.writes[c] && b.reads[c]) || (a.reads[c] && b.writes[c])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  inline void _build_graph() {
+    for (auto &s : _systems) {
+      s.successors.clear();
+      s.dependencies = 0;
+    }
+    for (size_t j = 0; j < _systems.size(); ++j) {
+      for (size_t i = 0; i < j; ++i) {
+        if (_conflict(_systems[i], _systems[j])) {
+          _systems[i].successors.push_back(j);
+          ++_systems[j].dependencies;
+        }
+      }
+    }
+    _graph_dirty = false;
+  }
+
+  world_type &_world;
+  thread_pool &_pool;
+  std::vector<system> _systems = {};
+  bool _graph_dirty = false;
+};
+
+// Records structural changes so they can be made later, at a point where no
+// view is iterating and no other thread is touching the world. A buffer is
+// not itself thread-safe; give each worker its own and apply them in turn.
+// Playback walks one pool at a time with its commands sorted by entity
+// (commands for the same entity keep their recorded order), after
+// registering created entities and before destroying removed ones.
+template <typename... Cs> struct command_buffer {
+  template <typename C, typename... Ts>
+  inline void add_component(entity e, Ts &&...ts) {
+    static_assert(std::is_constructible_v<C, Ts &&...>,
+                  "add_component(): arguments do not match any constructor "
+                  "of this component type");
+    auto &cmds = std::get<commands<C>>(_commands);
+    cmds.ops.push_back({e, static_cast<uint32_t>(cmds.values.size())});
+    cmds.values.emplace_back(std::forward<Ts>(ts)...);
+  }
+
+  template <typename C> inline void remove_component(entity e) {
+    std::get<commands<C>>(_commands).ops.push_back({e, _remove});
+  }
+
+  inline void remove_entity(entity e) { _destroyed.push_back(e); }
+
+  // Reserves an id from `world` without locking and registers it on apply().
+  // Ids are taken from the world in blocks, so most calls do not touch the
+  // shared counter; ids left in a block are simply never used. A buffer must
+  // only create entities in the one world it is applied to.
+  template <typename... Ws>
+  [[nodiscard]] inline entity create_entity(ecs<Ws...> &world) {
+    if (_block_next == _block_end) {
+      _block_next = world.reserve_entities(_id_block);
+      _block_end = _block_next + _id_block;
+    }
+    _created.push_back(_block_next);
+    return _block_next++;
+  }
+
+  inline bool empty() const {
+    return _created.empty() && _destroyed.empty() &&
+           (std::get<commands<Cs>>(_commands).ops.empty() && ...);
+  }
+
+  inline void clear() {
+    (std::get<commands<Cs>>(_commands).clear(), ...);
+    _created.clear();
+    _destroyed.clear();
+  }
+
+  // Adds replace components that already exist and removes of missing
+  // components are skipped. Components pinned by a smart_ref are left in
+  // place and the first such failure is returned once playback finishes.
+  template <typename... Ws>
+  inline std::expected<void, error> apply(ecs<Ws...> &world) {
+    std::expected<void, error> res{};
+    auto keep_first = [&](std::expected<void, error> r) {
+      if (!r && res) {
+        res = r;
+      }
+    };
+
+    world.commit_entities(_created);
+
+    auto play = [&]<typename C>(commands<C> &cmds) {
+      auto &pool = world.template pool_of<C>();
+      std::stable_sort(cmds.ops.begin(), cmds.ops.end(),
+                       [](const op &a, const op &b) { return a.e < b.e; });
+      for (const op &o : cmds.ops) {
+        if (o.payload == _remove) {
+          if (pool.has_component(o.e)) {
+            keep_first(pool.remove_element(o.e));
+          }
+        } else if (pool.has_component(o.e)) {
+          pool.replace_element_fast(o.e, std::move(cmds.values[o.payload]));
+        } else {
+          pool.add_element_fast(o.e, std::move(cmds.values[o.payload]));
+        }
+      }
+    };
+    (play(std::get<commands<Cs>>(_commands)), ...);
+
+    for (entity e : _destroyed) {
+      keep_first(world.template remove_entity<safety_policy::checked>(e));
+    }
+
+    clear();
+    return res;
+  }
+
+private:
+  constexpr static uint32_t _remove = std::numeric_limits<uint32_t>::max();
+  constexpr static entity _id_block = 64;
+
+  // payload indexes into values, or is _remove.
+  struct op {
+    entity e;
+    uint32_t payload;
+  };
+
+  template <typename C> struct commands {
+    std::vector<op> ops = {};
+    std::vector<C> values = {};
+
+    inline void clear() {
+      ops.clear();
+      values.clear();
+    }
+  };
+
+  std::tuple<commands<Cs>...> _commands = {};
+  std::vector<entity> _created = {};
+  std::vector<entity> _destroyed = {};
+  entity _block_next = 0;
+  entity _block_end = 0;
+};
+
+// Coroutine body driven by a task_scheduler. It does not start until the
+// scheduler it is spawned on next ticks.
+struct task {
+  struct promise_type {
+    inline task get_return_object() {
+      return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    inline std::suspend_always initial_suspend() noexcept { return {}; }
+    inline std::suspend_always final_suspend() noexcept { return {}; }
+    inline void return_void() {}
+    inline void unhandled_exception() { failure = std::current_exception(); }
+
+    std::exception_ptr failure = nullptr;
+  };
+  using handle = std::coroutine_handle<promise_type>;
+
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+  inline task(task &&other) noexcept
+      : _handle(std::exchange(other._handle, {})) {}
+  inline task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (_handle) {
+        _handle.destroy();
+      }
+      _handle = std::exchange(other._handle, {});
+    }
+    return *this;
+  }
+  inline ~task() {
+    if (_handle) {
+      _handle.destroy();
+    }
+  }
+
+  inline handle release() { return std::exchange(_handle, {}); }
+
+private:
+  explicit inline task(handle h) : _handle(h) {}
+
+  handle _handle = {};
+};
+
+// Owns spawned tasks and resumes them in batches from tick(). A suspended
+// task costs nothing per frame: frame waits sit in a heap keyed by their wake
+// frame, and component waits are only looked at when that component is added.
+// Tasks woken while tick() runs are resumed on the following tick.
+template <typename... Cs> struct task_scheduler {
+  using world_type = ecs<Cs...>;
+
+  explicit inline task_scheduler(world_type &world) : _world(world) {}
+
+  task_scheduler(const task_scheduler &) = delete;
+  task_scheduler &operator=(const task_scheduler &) = delete;
+
+  inline ~task_scheduler() {
+    (_unsubscribe<Cs>(), ...);
+    for (void *address : _live) {
+      task::handle::from_address(address).destroy();
+    }
+  }
+
+  inline void spawn(task t) {
+    task::handle h = t.release();
+    _live.insert(h.address());
+    _ready.push_back(h);
+  }
+
+  // Advances the frame counter and resumes every task that became due. The
+  // first exception a task lets escape is rethrown after the batch.
+  inline void tick() {
+    ++_frame;
+    while (!_sleeping.empty() && _sleeping.top().first <= _frame) {
+      _ready.push_back(_sleeping.top().second);
+      _sleeping.pop();
+    }
+    (_collect<Cs>(), ...);
+
+    std::vector<task::handle> batch;
+    batch.swap(_ready);
+    std::exception_ptr failure = nullptr;
+    for (task::handle h : batch) {
+      h.resume();
+      if (h.done()) {
+        if (h.promise().failure && !failure) {
+          failure = h.promise().failure;
+        }
+        _live.erase(h.address());
+        h.destroy();
+      }
+    }
+    if (failure) {
+      std::rethrow_exception(failure);
+    }
+  }
+
+  inline uint64_t frame() const { return _frame; }
+  inline size_t size() const { return _live.size(); }
+
+  struct frame_awaiter {
+    task_scheduler &scheduler;
+    uint64_t frames;
+
+    inline bool await_ready() const noexcept { return frames == 0; }
+    inline void await_suspend(task::handle h) {
+      scheduler._sleeping.emplace(scheduler._frame + frames, h);
+    }
+    inline void await_resume() const noexcept {}
+  };
+
+  template <typename C> struct component_awaiter {
+    task_scheduler &scheduler;
+    entity e;
+
+    inline bool await_ready() const {
+      return scheduler._world.template has_component<C>(e);
+    }
+    inline void await_suspend(task::handle h) {
+      scheduler._subscribe<C>();
+      std::get<waiters<C>>(scheduler._waiters).by_entity.emplace(e, h);
+    }
+    inline C &await_resume() const {
+      return scheduler._world.template get_component<C>(e);
+    }
+  };
+
+  // co_await next_frame() resumes on the next tick().
+  inline frame_awaiter next_frame() { return {*this, 1}; }
+  inline frame_awaiter wait_frames(uint64_t n) { return {*this, n}; }
+
+  // Resumes once `e` has a C, on the first tick() that finds it there, and
+  // yields it. If the component is removed again before that tick, the task
+  // keeps waiting.
+  template <typename C> inline component_awaiter<C> wait_for(entity e) {
+    return {*this, e};
+  }
+
+private:
+  template <typename C> struct waiters {
+    std::unordered_multimap<entity, task::handle> by_entity = {};
+    // Waiters whose component was added since the last tick.
+    std::vector<std::pair<entity, task::handle>> woken = {};
+    std::optional<typename signal<entity, C &>::connection> connection = {};
+  };
+
+  struct later {
+    inline bool operator()(const std::pair<uint64_t, task::handle> &a,
+                           const std::pair<uint64_t, task::handle> &b) const {
+      return a.first > b.first;
+    }
+  };
+
+  template <typename C> inline void _subscribe() {
+    auto &w = std::get<waiters<C>>(_waiters);
+    if (w.connection) {
+      return;
+    }
+    w.connection =
+        _world.template on_construct<C>().connect([this](entity e, C &) {
+          auto &w = std::get<waiters<C>>(_waiters);
+          auto [lo, hi] = w.by_entity.equal_range(e);
+          for (auto it = lo; it != hi; ++it) {
+            w.woken.emplace_back(e, it->second);
+          }
+          w.by_entity.erase(lo, hi);
+        });
+  }
+
+  // Readies the woken waiters whose component is still there and puts the
+  // others back to waiting.
+  template <typename C> inline void _collect() {
+    auto &w = std::get<waiters<C>>(_waiters);
+    for (auto [e, h] : w.woken) {
+      if (_world.template has_component<C>(e)) {
+        _ready.push_back(h);
+      } else {
+        w.by_entity.emplace(e, h);
+      }
+    }
+    w.woken.clear();
+  }
+
+  template <typename C> inline void _unsubscribe() {
+    auto &w = std::get<waiters<C>>(_waiters);
+    if (w.connection) {
+      _world.template on_construct<C>().disconnect(*w.connection);
+    }
+  }
+
+  world_type &_world;
+  uint64_t _frame = 0;
+  std::vector<task::handle> _ready = {};
+  std::priority_queue<std::pair<uint64_t, task::handle>,
+                      std::vector<std::pair<uint64_t, task::handle>>, later>
+      _sleeping = {};
+  std::tuple<waiters<Cs>...> _waiters = {};
+  std::unordered_set<void *> _live = {};
+};
+
+// A world split into independent shards, each a complete ecs<Cs...>, so
+// shards can be simulated on different cores. Ids handed out by a
+// sharded_ecs carry their shard in the top shard_bits bits; the shard itself
+// only sees the local part, which keeps its forward arrays dense. Moving an
+// entity to another shard gives it a new id.
+template <typename... Cs> struct sharded_ecs {
+  using world_type = ecs<Cs...>;
+
+  constexpr static unsigned shard_bits = 8;
+  constexpr static unsigned local_bits = 32 - shard_bits;
+  constexpr static entity local_mask = (entity{1} << local_bits) - 1;
+
+  inline sharded_ecs(size_t shards, thread_pool &workers)
+      : _shards(shards), _workers(workers) {
+    assert(shards > 0 && shards <= (size_t{1} << shard_bits));
+  }
+
+  inline static size_t shard_of(entity e) { return e >> local_bits; }
+  inline static entity local_of(entity e) { return e & local_mask; }
+  inline static entity global_id(size_t shard, entity local) {
+    assert(local <= local_mask);
+    return static_cast<entity>(shard << local_bits) | local;
+  }
+
+  inline size_t shard_count() const { return _shards.size(); }
+  inline world_type &shard(size_t i) { return _shards[i]; }
+
+  [[nodiscard]] inline entity add_entity(size_t shard) {
+    return global_id(shard, _shards[shard].add_entity());
+  }
+
+  inline void remove_entity(entity e) {
+    _shards[shard_of(e)].remove_entity(local_of(e));
+  }
+
+  template <typename C, typename... Ts>
+  inline void add_component(entity e, Ts &&...ts) {
+    _shards[shard_of(e)].template add_component<C>(local_of(e),
+                                                   std::forward<Ts>(ts)...);
+  }
+
+  template <typename C> inline void remove_component(entity e) {
+    _shards[shard_of(e)].template remove_component<C>(local_of(e));
+  }
+
+  template <typename C> [[nodiscard]] inline C &get_component(entity e) {
+    return _shards[shard_of(e)].template get_component<C>(local_of(e));
+  }
+
+  template <typename C> inline bool has_component(entity e) {
+    return _shards[shard_of(e)].template has_component<C>(local_of(e));
+  }
+
+  // Moves a batch of entities, with all their components, into shard `to`
+  // and returns their new ids in the same order. Work is grouped per source
+  // shard and per component type, with one id reservation and one pool
+  // reservation per group. Entities with a component pinned by a smart_ref
+  // are left where they are and come back as invalid_entity.
+  inline std::vector<entity> migrate(std::span<const entity> es, size_t to) {
+    std::vector<entity> res(es.size(), invalid_entity);
+    world_type &dst = _shards[to];
+
+    std::vector<std::vector<size_t>> by_shard(_shards.size());
+    for (size_t i = 0; i < es.size(); ++i) {
+      by_shard[shard_of(es[i])].push_back(i);
+    }
+
+    for (size_t from = 0; from < _shards.size(); ++from) {
+      if (from == to) {
+        for (size_t i : by_shard[from]) {
+          res[i] = es[i];
+        }
+        continue;
+      }
+      if (by_shard[from].empty()) {
+        continue;
+      }
+      world_type &src = _shards[from];
+
+      std::vector<entity> moving, moved_to;
+      std::vector<size_t> slots;
+      for (size_t i : by_shard[from]) {
+        if (!_pinned(src, local_of(es[i]))) {
+          moving.push_back(local_of(es[i]));
+          slots.push_back(i);
+        }
+      }
+      if (moving.empty()) {
+        continue;
+      }
+
+      const entity first = dst.reserve_entities(moving.size());
+      for (size_t k = 0; k < moving.size(); ++k) {
+        moved_to.push_back(first + static_cast<entity>(k));
+        res[slots[k]] = global_id(to, moved_to.back());
+      }
+      dst.commit_entities(moved_to);
+
+      (_move_pool<Cs>(src, dst, moving, moved_to), ...);
+      src.remove_entities(moving);
+    }
+    return res;
+  }
+
+  inline entity migrate(entity e, size_t to) {
+    return migrate(std::span<const entity>(&e, 1), to)[0];
+  }
+
+  // Calls f(shard_index, shard) for every shard in parallel.
+  template <typename F> inline void parallel(F &&f) {
+    _workers.parallel_for(_shards.size(),
+                          [&](size_t i) { f(i, _shards[i]); });
+  }
+
+  // Calls f(global_entity, Ccs &...) for every entity in every shard that has
+  // all of Ccs. Shards are visited in parallel, so f must tolerate being
+  // called from several threads at once (never for the same entity).
+  template <typename... Ccs, typename F> inline void for_each(F &&f) {
+    parallel([&](size_t i, world_type &w) {
+      for (auto [e, cs] : view<Ccs...>(w)) {
+        std::apply([&](Ccs &...c) { f(global_id(i, e), c...); }, cs);
+      }
+    });
+  }
+
+private:
+  inline static bool _pinned(world_type &w, entity e) {
+    auto pinned = [&]<typename C>(_private::component_pool<C> &pool) {
+      return pool.has_component(e) && pool.refcounts[pool.forward[e]] != 0;
+    };
+    return (pinned(w.template pool_of<Cs>()) || ...);
+  }
+
+  template <typename C>
+  inline static void _move_pool(world_type &src, world_type &dst,
+                                std::span<const entity> from,
+                                std::span<const entity> to) {
+    auto &src_pool = src.template pool_of<C>();
+    auto &dst_pool = dst.template pool_of<C>();
+    size_t count = 0;
+    for (entity e : from) {
+      count += src_pool.has_component(e);
+    }
+    if (count == 0) {
+      return;
+    }
+    dst_pool.data.reserve(dst_pool.data.size() + count);
+    dst_pool.back.reserve(dst_pool.back.size() + count);
+    dst_pool.refcounts.reserve(dst_pool.refcounts.size() + count);
+    for (size_t k = 0; k < from.size(); ++k) {
+      if (src_pool.has_component(from[k])) {
+        dst_pool.add_element_fast(
+            to[k], std::move(src_pool.get_element_fast(from[k])));
+        src_pool.remove_element_fast(from[k]);
+      }
+    }
+  }
+
+  std::vector<world_type> _shards;
+  thread_pool &_workers;
+};
+
+// Bounded rollback history for a world, e.g. for lockstep re-simulation.
+// mark() sets a checkpoint at a frame boundary; rewind(n) puts the world back
+// to the n-th most recent checkpoint (1 drops what happened since the last
+// one). Up to capacity checkpoints are kept, the first one being taken on
+// construction. Each frame records undo information: old values on the first
+// write to a component, removals with their slot, additions, and entity
+// creation and destruction, so memory per frame follows what changed. Views
+// log the elements they hand out mutably like any other write; only a view's
+// components() span, which can be written anywhere, copies the whole pool
+// into the frame. Rewinding restores data, back, forward, refcounts, the
+// entity list and the id counter. Component listeners are notified as for
+// the inverse operations, so indexes follow the rewind; entity listeners are
+// not. Rewound components must not be held by smart_refs.
+template <typename... Cs> struct world_history {
+  inline explicit world_history(ecs<Cs...> &world, size_t capacity = 8)
+      : _world(world), _logs(_private::undo_log<Cs>(capacity)...),
+        _entities(capacity) {
+    _attach(std::index_sequence_for<Cs...>{});
+    _entities.open().counter = _counter();
+    _on_create = world.on_entity_create().connect([this](entity e) {
+      _entities.open().events.emplace_back(e, true);
+    });
+    _on_destroy = world.on_entity_destroy().connect([this](entity e) {
+      _entities.open().events.emplace_back(e, false);
+    });
+  }
+
+  world_history(const world_history &) = delete;
+  world_history &operator=(const world_history &) = delete;
+
+  inline ~world_history() {
+    ((_world.template pool_of<Cs>().undo = nullptr), ...);
+    _world.on_entity_create().disconnect(_on_create);
+    _world.on_entity_destroy().disconnect(_on_destroy);
+  }
+
+  inline void mark() {
+    (std::get<_private::undo_log<Cs>>(_logs).next_frame(), ...);
+    _entities.advance().counter = _counter();
+  }
+
+  inline size_t checkpoints() const { return _entities.size(); }
+
+  inline void rewind(size_t n = 1) {
+    assert(n >= 1 && n <= checkpoints());
+    auto undo = [&]<typename C>(_private::undo_log<C> &log) {
+      auto &pool = _world.template pool_of<C>();
+      log.rewind(n, [&](auto &frame) { pool.undo_frame(frame); });
+    };
+    (undo(std::get<_private::undo_log<Cs>>(_logs)), ...);
+    _entities.rewind(n, [&](entity_frame &f) { _undo_entities(f); });
+  }
+
+private:
+  struct entity_frame {
+    entity counter = 0;
+    std::vector<std::pair<entity, bool>> events = {};
+
+    inline void clear() { events.clear(); }
+  };
+
+  template <std::size_t... I> inline void _attach(std::index_sequence<I...>) {
+    ((_world.template pool_of<Cs>().undo = &std::get<I>(_logs)), ...);
+  }
+
+  inline entity _counter() const {
+    return _world._entity_counter.load(std::memory_order_relaxed);
+  }
+
+  // An entity's state at the start of the frame is the opposite of its
+  // first event there, and its state now is its last event.
+  inline void _undo_entities(entity_frame &f) {
+    std::unordered_map<entity, std::pair<bool, bool>> net;
+    for (auto [e, created] : f.events) {
+      auto [it, fresh] = net.try_emplace(e, created, created);
+      it->second.second = created;
+    }
+    std::unordered_set<entity> erase;
+    for (auto [e, state] : net) {
+      if (state.first && state.second) {
+        erase.insert(e);
+      } else if (!state.first && !state.second) {
+        _world._entities.push_back(e);
+      }
+    }
+    if (!erase.empty()) {
+      std::erase_if(_world._entities.write(),
+                    [&](entity e) { return erase.contains(e); });
+    }
+    _world._entity_counter.store(f.counter, std::memory_order_relaxed);
+  }
+
+  ecs<Cs...> &_world;
+  std::tuple<_private::undo_log<Cs>...> _logs;
+  _private::frame_ring<entity_frame> _entities;
+  signal<entity>::connection _on_create = 0;
+  signal<entity>::connection _on_destroy = 0;
+};
+
+#if MM_ECS_HAS_MMAP
+// Publishes a world to other processes through POSIX shared memory. Every
+// pool must use pool_storage::mapped; its arrays are moved into shared memory
+// objects named "<name>.<index>.data", ".back" and ".forward", so readers see
+// the live arrays without any copying. The entity list is published to
+// "<name>.entities" and a sequence counter lives in "<name>.ctl". Everything
+// inside the objects refers to other data by offset, never by pointer.
+//
+// Readers use the counter as a seqlock, so all changes to the world must be
+// made inside write(): the counter is odd while a write is open, and readers
+// retry until they saw a whole snapshot between two writes. The objects are
+// unlinked when the writer goes away; mappings that readers hold stay valid.
+template <typename... Cs> struct shm_writer {
+  static_assert((_private::component_pool<Cs>::mapped && ...),
+                "shm_writer: every pool must use pool_storage::mapped");
+
+  // Fails with mapping_failed if the name is taken, so a live writer's
+  // objects are never replaced; objects left behind by a writer that did not
+  // exit cleanly can be removed with unlink.
+  inline static std::expected<shm_writer, error>
+  create(ecs<Cs...> &world, const std::string &name) {
+    shm_writer w;
+    const int claim =
+        ::shm_open((name + ".ctl").c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (claim < 0) {
+      return std::unexpected(error::mapping_failed);
+    }
+    ::close(claim);
+    // From here on the objects are ours to unlink if anything fails; arrays
+    // still present under the name were left by a writer that went away.
+    w._name = name;
+    _unlink_arrays(name);
+    auto control = _private::mapped_vector<uint64_t>::open(
+        name + ".ctl", _private::schema_hash<Cs...>(), true);
+    if (!control) {
+      return std::unexpected(control.error());
+    }
+    auto entities = _private::mapped_vector<entity>::open(
+        name + ".entities", _private::type_hash<entity>(), true);
+    if (!entities) {
+      return std::unexpected(entities.error());
+    }
+    w._control = std::move(*control);
+    w._control.resize(_private::shared_slots, 0);
+    w._entities = std::move(*entities);
+
+    std::optional<error> failure;
+    size_t index = 0;
+    auto share = [&](auto &pool) {
+      if (!failure) {
+        if (auto res = pool.map(_pool_name(name, index), true); !res) {
+          failure = res.error();
         }
       }
-      if constexpr (saf_policy == safety_policy::checked) {
-        if constexpr (rem_policy == remove_policy::lax) {
-          return {};
-        } else {
-          return std::unexpected(error::component_does_not_exist);
-        }
+      ++index;
+    };
+    (share(world.template pool_of<Cs>()), ...);
+    if (failure) {
+      return std::unexpected(*failure);
+    }
+
+    w._world = &world;
+    w._connect();
+    w._publish_entities();
+    return w;
+  }
+
+  // Removes the shared memory objects published under name.
+  inline static void unlink(const std::string &name) {
+    ::shm_unlink((name + ".ctl").c_str());
+    _unlink_arrays(name);
+  }
+
+  shm_writer(const shm_writer &) = delete;
+  shm_writer &operator=(const shm_writer &) = delete;
+  inline shm_writer(shm_writer &&other) noexcept
+      : _world(other._world), _name(std::move(other._name)),
+        _control(std::move(other._control)),
+        _entities(std::move(other._entities)),
+        _dirty(std::move(other._dirty)), _on_create(other._on_create),
+        _on_destroy(other._on_destroy) {
+    other._world = nullptr;
+    other._name.clear();
+  }
+
+  // _world is only set once the listeners are connected, and _name once the
+  // objects were claimed, so a failed create releases exactly what it took.
+  inline ~shm_writer() {
+    if (_world != nullptr) {
+      _world->on_entity_create().disconnect(_on_create);
+      _world->on_entity_destroy().disconnect(_on_destroy);
+    }
+    if (!_name.empty()) {
+      unlink(_name);
+    }
+  }
+
+  // Opens a write; readers retry until the matching end_write.
+  inline void begin_write() {
+    _seq().store(_seq().load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  inline void end_write() {
+    if (*_dirty) {
+      _publish_entities();
+    }
+    std::atomic_ref<uint64_t>(_control[_private::shared_counter])
+        .store(_world->_entity_counter.load(std::memory_order_relaxed),
+               std::memory_order_relaxed);
+    _seq().store(_seq().load(std::memory_order_relaxed) + 1,
+                 std::memory_order_release);
+  }
+
+  struct write_guard {
+    shm_writer &writer;
+    inline ~write_guard() { writer.end_write(); }
+  };
+
+  // auto guard = writer.write(); ... changes ... (published at scope exit)
+  [[nodiscard]] inline write_guard write() {
+    begin_write();
+    return write_guard{*this};
+  }
+
+private:
+  shm_writer() = default;
+
+  inline static std::string _pool_name(const std::string &name,
+                                       size_t index) {
+    return name + "." + std::to_string(index);
+  }
+
+  inline static void _unlink_arrays(const std::string &name) {
+    ::shm_unlink((name + ".entities").c_str());
+    for (size_t i = 0; i < sizeof...(Cs); ++i) {
+      for (const char *array : {".data", ".back", ".forward"}) {
+        ::shm_unlink((_pool_name(name, i) + array).c_str());
+      }
+    }
+  }
+
+  inline std::atomic_ref<uint64_t> _seq() {
+    return std::atomic_ref<uint64_t>(_control[_private::shared_seq]);
+  }
+
+  // The flag lives on the heap so the listeners survive moves.
+  inline void _connect() {
+    bool *dirty = _dirty.get();
+    _on_create = _world->on_entity_create().connect(
+        [dirty](entity) { *dirty = true; });
+    _on_destroy = _world->on_entity_destroy().connect(
+        [dirty](entity) { *dirty = true; });
+  }
+
+  inline void _publish_entities() {
+    _entities.assign(_world->_entities.cbegin(), _world->_entities.cend());
+    *_dirty = false;
+  }
+
+  ecs<Cs...> *_world = nullptr;
+  std::string _name = {};
+  _private::mapped_vector<uint64_t> _control = {};
+  _private::mapped_vector<entity> _entities = {};
+  std::unique_ptr<bool> _dirty = std::make_unique<bool>(true);
+  signal<entity>::connection _on_create = 0;
+  signal<entity>::connection _on_destroy = 0;
+};
+
+// Reads a world published by a shm_writer, typically from another process.
+// Reads happen inside read(f): f gets the reader and copies out what it
+// needs through its accessors, and is called again if the writer changed
+// anything meanwhile, so it must not keep references past its return.
+template <typename... Cs> struct shm_reader {
+  inline static std::expected<shm_reader, error>
+  open(const std::string &name) {
+    shm_reader r;
+    auto control = _private::shared_array<uint64_t>::open(
+        name + ".ctl", _private::schema_hash<Cs...>());
+    if (!control) {
+      return std::unexpected(control.error());
+    }
+    auto entities = _private::shared_array<entity>::open(
+        name + ".entities", _private::type_hash<entity>());
+    if (!entities) {
+      return std::unexpected(entities.error());
+    }
+    r._control = std::move(*control);
+    r._entities = std::move(*entities);
+    if (r._control.size() < _private::shared_slots) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+
+    std::optional<error> failure;
+    auto attach = [&]<size_t I>(std::integral_constant<size_t, I>) {
+      using C = std::tuple_element_t<I, std::tuple<Cs...>>;
+      auto &pool = std::get<I>(r._pools);
+      const std::string base = name + "." + std::to_string(I);
+      auto d = _private::shared_array<C>::open(base + ".data",
+                                               _private::type_hash<C>());
+      auto b = _private::shared_array<entity>::open(
+          base + ".back", _private::type_hash<entity>());
+      auto f = _private::shared_array<size_t>::open(
+          base + ".forward", _private::type_hash<size_t>());
+      if (!d || !b || !f) {
+        failure = !d ? d.error() : !b ? b.error() : f.error();
+        return;
       }
+      pool.data = std::move(*d);
+      pool.back = std::move(*b);
+      pool.forward = std::move(*f);
     };
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      (attach(std::integral_constant<size_t, I>{}), ...);
+    }(std::index_sequence_for<Cs...>{});
+    if (failure) {
+      return std::unexpected(*failure);
+    }
+    return r;
+  }
 
-    if constexpr (saf_policy == safety_policy::checked) {
-      std::expected<void, error> res{};
+  // Calls f(*this) until it ran entirely between two writes, and returns
+  // what it returned then.
+  template <typename F> inline auto read(F &&f) {
+    while (true) {
+      const uint64_t before = _seq().load(std::memory_order_acquire);
+      if (before % 2 == 0) {
+        _refresh();
+        auto result = f(*this);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_seq().load(std::memory_order_relaxed) == before) {
+          return result;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
 
-      auto try_remove = [&](auto &pool) {
-        if (!res)
-          return;
-        res = checked_remove(pool, e);
-      };
+  // Accessors, only meaningful inside read.
+  inline std::span<const entity> entities() const {
+    return _entities.span();
+  }
 
-      (try_remove(std::get<_private::component_pool<Ccs>>(_data)), ...);
+  inline entity entity_counter() const {
+    return static_cast<entity>(_control.data()[_private::shared_counter]);
+  }
 
-      return res;
-    } else {
-      (checked_remove(std::get<_private::component_pool<Ccs>>(_data), e), ...);
+  template <typename C> inline std::span<const C> components() const {
+    return _pool<C>().data.span();
+  }
+
+  // Entities owning each element of components<C>(), in the same order.
+  template <typename C> inline std::span<const entity> owners() const {
+    return _pool<C>().back.span();
+  }
+
+  template <typename C> inline std::optional<C> get(entity e) const {
+    const auto &pool = _pool<C>();
+    const auto forward = pool.forward.span();
+    if (e >= forward.size()) {
+      return std::nullopt;
+    }
+    const size_t idx = forward[e];
+    const auto data = pool.data.span();
+    if (idx >= data.size()) {
+      return std::nullopt;
     }
+    return data[idx];
   }
 
-  [[nodiscard]] inline entity add_entity() {
-    _entities.push_back(_entity_counter++);
-    return _entities.back();
+private:
+  template <typename C> struct pool_arrays {
+    _private::shared_array<C> data;
+    _private::shared_array<entity> back;
+    _private::shared_array<size_t> forward;
+  };
+
+  shm_reader() = default;
+
+  template <typename C> inline const pool_arrays<C> &_pool() const {
+    return std::get<pool_arrays<C>>(_pools);
   }
 
-  template <safety_policy policy = safety_policy::unchecked>
-  inline method_result_void_t<policy> remove_entity(entity e) {
-    if (auto result = std::find(_entities.cbegin(), _entities.cend(), e);
-        result != _entities.cend()) {
-      _entities.erase(result);
-    } else {
-      if constexpr (policy == safety_policy::checked) {
-        return std::unexpected(error::no_such_entity);
+  inline std::atomic_ref<uint64_t> _seq() const {
+    return std::atomic_ref<uint64_t>(
+        const_cast<uint64_t &>(_control.data()[_private::shared_seq]));
+  }
+
+  inline void _refresh() {
+    _entities.refresh();
+    auto refresh = [](auto &pool) {
+      pool.data.refresh();
+      pool.back.refresh();
+      pool.forward.refresh();
+    };
+    std::apply([&](auto &...pools) { (refresh(pools), ...); }, _pools);
+  }
+
+  _private::shared_array<uint64_t> _control = {};
+  _private::shared_array<entity> _entities = {};
+  std::tuple<pool_arrays<Cs>...> _pools = {};
+};
+#endif
+
+// Where change streams write and where appliers read. write returns false
+// on failure; read fills as much of the span as it can and returns how much
+// that was, so a short read means the end of the stream.
+template <typename S>
+concept byte_sink = requires(S &s, std::span<const char> bytes) {
+  { s.write(bytes) } -> std::convertible_to<bool>;
+};
+
+template <typename S>
+concept byte_source = requires(S &s, std::span<char> bytes) {
+  { s.read(bytes) } -> std::convertible_to<size_t>;
+};
+
+struct ostream_sink {
+  std::ostream &os;
+  inline bool write(std::span<const char> bytes) {
+    return static_cast<bool>(
+        os.write(bytes.data(), static_cast<std::streamsize>(bytes.size())));
+  }
+};
+
+struct istream_source {
+  std::istream &is;
+  inline size_t read(std::span<char> bytes) {
+    is.read(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<size_t>(is.gcount());
+  }
+};
+
+#if MM_ECS_HAS_MMAP
+// Pipes, sockets and files. The descriptor stays owned by the caller.
+struct fd_sink {
+  int fd;
+  inline bool write(std::span<const char> bytes) {
+    while (!bytes.empty()) {
+      const ssize_t n = ::write(fd, bytes.data(), bytes.size());
+      if (n < 0 && errno == EINTR) {
+        continue;
       }
+      if (n <= 0) {
+        return false;
+      }
+      bytes = bytes.subspan(static_cast<size_t>(n));
     }
+    return true;
+  }
+};
 
-    if constexpr (policy == safety_policy::checked) {
-      if (auto result = remove_components<remove_policy::lax,
-                                          safety_policy::checked, Cs...>(e);
-          !result) {
-        return result;
+struct fd_source {
+  int fd;
+  inline size_t read(std::span<char> bytes) {
+    size_t done = 0;
+    while (done < bytes.size()) {
+      const ssize_t n = ::read(fd, bytes.data() + done, bytes.size() - done);
+      if (n < 0 && errno == EINTR) {
+        continue;
       }
-      return {};
-    } else {
-      remove_components<remove_policy::lax, safety_policy::unchecked, Cs...>(e);
-      return;
+      if (n <= 0) {
+        break;
+      }
+      done += static_cast<size_t>(n);
     }
+    return done;
   }
+};
+#endif
 
-  template <typename C> _private::component_pool<C> &pool_of() {
-    return std::get<_private::component_pool<C>>(_data);
+enum class change_kind : uint8_t {
+  entity_created,
+  entity_destroyed,
+  component_added,
+  component_replaced,
+  component_removed
+};
+
+constexpr uint32_t change_batch_magic = 0x43454d4d; // "MMEC"
+
+// Streams a world's mutations to a byte sink, for replicas kept in sync by a
+// change_applier. Events come from the world's signals, in the order they
+// happen: entity creation and destruction, and component additions,
+// replacements (including patch_component) and removals, with the component
+// value. Writes made through get_component or views raise no signal and are
+// not streamed. Events are buffered into batches, each with a header holding
+// its length, event count, sequence number and a hash of the component list;
+// a batch is written once it reaches batch_bytes and on flush.
+template <byte_sink Sink, typename... Cs> struct change_stream {
+  static_assert((snapshottable<Cs> && ...),
+                "change_stream: every component needs to be trivially "
+                "copyable or have a serializer");
+  static_assert(sizeof...(Cs) <= std::numeric_limits<uint8_t>::max());
+
+  inline change_stream(ecs<Cs...> &world, Sink &sink,
+                       size_t batch_bytes = 64 * 1024)
+      : _world(world), _sink(sink), _batch_bytes(batch_bytes) {
+    _buf.out = &_batch;
+    _batch.reserve(batch_bytes + 64);
+    _on_create = world.on_entity_create().connect(
+        [this](entity e) { _event(change_kind::entity_created, e); });
+    _on_destroy = world.on_entity_destroy().connect(
+        [this](entity e) { _event(change_kind::entity_destroyed, e); });
+    _subscribe(std::index_sequence_for<Cs...>{});
   }
 
-  template <typename C> const _private::component_pool<C> &pool_of() const {
-    return std::get<_private::component_pool<C>>(_data);
+  change_stream(const change_stream &) = delete;
+  change_stream &operator=(const change_stream &) = delete;
+
+  inline ~change_stream() {
+    (void)flush();
+    _world.on_entity_create().disconnect(_on_create);
+    _world.on_entity_destroy().disconnect(_on_destroy);
+  }
+
+  // Writes the pending batch, if any. Returns the first write failure since
+  // the last flush.
+  inline std::expected<void, error> flush() {
+    if (_pending != 0) {
+      std::array<char, 28> header;
+      const uint32_t bytes = static_cast<uint32_t>(_batch.size());
+      const uint64_t schema = _private::schema_hash<Cs...>();
+      std::memcpy(header.data(), &change_batch_magic, 4);
+      std::memcpy(header.data() + 4, &bytes, 4);
+      std::memcpy(header.data() + 8, &_pending, 4);
+      std::memcpy(header.data() + 12, &_sequence, 8);
+      std::memcpy(header.data() + 20, &schema, 8);
+      _failed |= !_sink.write(header) || !_sink.write(_batch);
+      _events += _pending;
+      _pending = 0;
+      ++_sequence;
+      _batch.clear();
+    }
+    if (_failed) {
+      _failed = false;
+      return std::unexpected(error::stream_io_failed);
+    }
+    return {};
   }
 
+  // Events written so far, not counting the pending batch.
+  inline uint64_t events() const { return _events; }
+  inline uint64_t batches() const { return _sequence; }
+
 private:
-  std::tuple<_private::component_pool<Cs>...> _data = {};
-  std::vector<entity> _entities = {};
-  entity _entity_counter = 0;
+  inline void _event(change_kind kind, entity e) {
+    _batch.push_back(static_cast<char>(kind));
+    _append(e);
+    _end_event();
+  }
 
-  template <typename... Ccs> friend struct view;
+  template <uint8_t I, typename C>
+  inline void _component_event(change_kind kind, entity e, const C *c) {
+    _batch.push_back(static_cast<char>(kind));
+    _append(e);
+    _batch.push_back(static_cast<char>(I));
+    if (c != nullptr) {
+      if constexpr (has_serializer<C>) {
+        std::ostream os(&_buf);
+        serializer<C>::save(os, *c);
+      } else {
+        _append(*c);
+      }
+    }
+    _end_event();
+  }
+
+  template <typename T> inline void _append(const T &v) {
+    const char *p = reinterpret_cast<const char *>(&v);
+    _batch.insert(_batch.end(), p, p + sizeof(T));
+  }
+
+  inline void _end_event() {
+    ++_pending;
+    if (_batch.size() >= _batch_bytes) {
+      (void)flush();
+    }
+  }
+
+  template <std::size_t... I>
+  inline void _subscribe(std::index_sequence<I...>) {
+    (_subscribe_one<static_cast<uint8_t>(I), Cs>(), ...);
+  }
+
+  template <uint8_t I, typename C> inline void _subscribe_one() {
+    std::get<I>(_subscriptions) =
+        std::make_unique<_private::pool_subscription<C>>(
+            _world.template pool_of<C>(),
+            [this](entity e, C &c) {
+              _component_event<I>(change_kind::component_added, e, &c);
+            },
+            [this](entity e, C &c) {
+              _component_event<I>(change_kind::component_replaced, e, &c);
+            },
+            [this](entity e, C &) {
+              _component_event<I, C>(change_kind::component_removed, e,
+                                     nullptr);
+            });
+  }
+
+  ecs<Cs...> &_world;
+  Sink &_sink;
+  size_t _batch_bytes;
+  std::vector<char> _batch = {};
+  _private::append_buf _buf = {};
+  uint32_t _pending = 0;
+  uint64_t _sequence = 0;
+  uint64_t _events = 0;
+  bool _failed = false;
+  signal<entity>::connection _on_create = 0;
+  signal<entity>::connection _on_destroy = 0;
+  std::tuple<std::unique_ptr<_private::pool_subscription<Cs>>...>
+      _subscriptions = {};
 };
 
-template <typename... Ccs> struct view {
-  inline constexpr static bool enable_borrowed_range = true; // potentially
-                                                             // dangerous
-  view() = delete;
-  template <typename... Cs>
-  inline view(ecs<Cs...> &c)
-      : _pools({std::get<_private::component_pool<Ccs>>(c._data)...}) {}
+template <typename Sink, typename... Cs>
+change_stream(ecs<Cs...> &, Sink &, size_t = 0) -> change_stream<Sink, Cs...>;
 
-  struct iterator {
-    using iterator_category = std::forward_iterator_tag;
-    using value_type = std::pair<entity, std::tuple<Ccs &...>>;
-    using difference_type = std::ptrdiff_t;
-    using pointer = void;
-    using reference = value_type;
-    inline iterator(view<Ccs...> &view, size_t index)
-        : _view(view), _index(index), _smallest(view._smallest_pool()) {
-      _skip_non_matching();
+// Replays a change_stream into another world of the same component types.
+// Batches must arrive in order; each one is read whole before it is applied.
+// An event of unknown kind fails the batch with snapshot_incompatible.
+// The replica's ids match the source's, so it should not create entities of
+// its own.
+template <typename... Cs> struct change_applier {
+  // Reads and applies one batch. Returns false at a clean end of stream.
+  template <byte_source Source>
+  inline std::expected<bool, error> apply_batch(ecs<Cs...> &world,
+                                                Source &source) {
+    std::array<char, 28> header;
+    const size_t got = source.read(header);
+    if (got == 0) {
+      return false;
+    }
+    uint32_t magic = 0, bytes = 0, count = 0;
+    uint64_t sequence = 0, schema = 0;
+    if (got != header.size()) {
+      return std::unexpected(error::stream_io_failed);
+    }
+    std::memcpy(&magic, header.data(), 4);
+    std::memcpy(&bytes, header.data() + 4, 4);
+    std::memcpy(&count, header.data() + 8, 4);
+    std::memcpy(&sequence, header.data() + 12, 8);
+    std::memcpy(&schema, header.data() + 20, 8);
+    if (magic != change_batch_magic || sequence != _sequence ||
+        schema != _private::schema_hash<Cs...>()) {
+      return std::unexpected(error::snapshot_incompatible);
     }
 
-    inline iterator &operator++() {
-      _index++;
-      _skip_non_matching();
-      return *this;
+    _batch.resize(bytes);
+    if (source.read(std::span<char>(_batch)) != bytes) {
+      return std::unexpected(error::stream_io_failed);
     }
 
-    inline bool operator!=(const iterator &other) const {
-      return _index != other._index;
+    std::ispanstream is{std::span<char>(_batch)};
+    for (uint32_t i = 0; i < count; ++i) {
+      uint8_t kind = 0;
+      entity e = invalid_entity;
+      if (!_private::read_value(is, kind) || !_private::read_value(is, e)) {
+        return std::unexpected(error::stream_io_failed);
+      }
+      if (kind > static_cast<uint8_t>(change_kind::component_removed)) {
+        return std::unexpected(error::snapshot_incompatible);
+      }
+      // Runs of destructions are unregistered together, in one pass over
+      // the replica's entity list.
+      if (kind != static_cast<uint8_t>(change_kind::entity_destroyed) &&
+          !_destroyed.empty()) {
+        world.remove_entities(_destroyed);
+        _destroyed.clear();
+      }
+      switch (static_cast<change_kind>(kind)) {
+      case change_kind::entity_created:
+        world._adopt_entities(std::span<const entity>(&e, 1));
+        break;
+      case change_kind::entity_destroyed:
+        _destroyed.push_back(e);
+        break;
+      case change_kind::component_added:
+      case change_kind::component_replaced:
+      case change_kind::component_removed:
+        if (!_apply_component(world, is, static_cast<change_kind>(kind), e,
+                              std::index_sequence_for<Cs...>{})) {
+          return std::unexpected(error::stream_io_failed);
+        }
+      }
     }
+    world.remove_entities(_destroyed);
+    _destroyed.clear();
+    ++_sequence;
+    _events += count;
+    return true;
+  }
 
-    inline bool operator==(const iterator &other) const {
-      return _index == other._index;
+  // Applies batches until the stream ends. Returns the events applied.
+  template <byte_source Source>
+  inline std::expected<uint64_t, error> apply_all(ecs<Cs...> &world,
+                                                  Source &source) {
+    const uint64_t before = _events;
+    while (true) {
+      auto more = apply_batch(world, source);
+      if (!more) {
+        return std::unexpected(more.error());
+      }
+      if (!*more) {
+        return _events - before;
+      }
     }
+  }
 
-    inline std::pair<entity, std::tuple<Ccs &...>> operator*() {
-      auto e = _first_matching();
-      assert(_has_all(e) == true);
-      return std::forward_as_tuple(e, _view._get_components(e));
+  inline uint64_t events() const { return _events; }
+
+private:
+  template <std::size_t... I>
+  inline bool _apply_component(ecs<Cs...> &world, std::istream &is,
+                               change_kind kind, entity e,
+                               std::index_sequence<I...>) {
+    uint8_t index = 0;
+    if (!_private::read_value(is, index) || index >= sizeof...(Cs)) {
+      return false;
     }
+    bool ok = false;
+    ((I == index ? (ok = _apply_one<Cs>(world, is, kind, e)) : false), ...);
+    return ok;
+  }
 
-  private:
-    inline void _skip_non_matching() {
-      while (_index < _smallest->size()) {
-        if (_has_all(_first_matching())) {
-          break;
-        }
-        ++_index;
+  template <typename C>
+  inline bool _apply_one(ecs<Cs...> &world, std::istream &is,
+                         change_kind kind, entity e) {
+    _private::component_pool<C> &pool = world.template pool_of<C>();
+    if (kind == change_kind::component_removed) {
+      if (pool.has_component(e)) {
+        pool.remove_element_fast(e);
       }
+      return true;
     }
 
-    bool _has_all(entity e) const {
-      return _has_all_impl(e, std::index_sequence_for<Ccs...>{});
+    auto store = [&](C &&value) {
+      if (pool.has_component(e)) {
+        pool.replace_element_fast(e, std::move(value));
+      } else {
+        pool.add_element_fast(e, std::move(value));
+      }
+    };
+    if constexpr (has_serializer<C>) {
+      C value = serializer<C>::load(is);
+      if (!is) {
+        return false;
+      }
+      store(std::move(value));
+    } else {
+      std::array<char, sizeof(C)> raw;
+      if (!_private::read_value(is, raw)) {
+        return false;
+      }
+      store(std::bit_cast<C>(raw));
     }
+    return true;
+  }
 
-    template <std::size_t... I>
-    bool _has_all_impl(entity e, std::index_sequence<I...>) const {
-      return (... && std::get<I>(_view._pools).has_component(e));
-    }
+  std::vector<char> _batch = {};
+  std::vector<entity> _destroyed = {};
+  uint64_t _sequence = 0;
+  uint64_t _events = 0;
+};
 
-    entity _first_matching() const { return (*_smallest)[_index]; }
+enum class trace_op : uint8_t { create, destroy, add, remove, view };
 
-    view<Ccs...> &_view;
-    size_t _index = _private::invalid_component_index;
-    std::vector<entity> *_smallest;
-  };
+constexpr uint32_t trace_magic = 0x54454d4d; // "MMET"
+constexpr uint32_t trace_version = 1;
 
-  inline iterator begin() { return iterator(*this, 0); }
-  inline iterator end() { return iterator(*this, _smallest_pool()->size()); }
+// The view types a trace may contain, e.g.
+// trace_views<view<position>, view<position, velocity>>. Recording and replay
+// name the same list, so a recorded view is replayed as that view type.
+template <typename... Vs> struct trace_views {};
 
-private:
-  std::vector<entity> *_smallest_pool() {
-    return _smallest_pool_impl(std::index_sequence_for<Ccs...>{});
+namespace _private {
+template <typename V, typename... Vs>
+constexpr uint32_t trace_view_index(trace_views<Vs...>) {
+  constexpr std::array<bool, sizeof...(Vs)> same = {std::is_same_v<V, Vs>...};
+  return static_cast<uint32_t>(std::ranges::find(same, true) - same.begin());
+}
+} // namespace _private
+
+// Records the structural workload run against a world as a compact binary
+// trace, which replay_trace re-executes against a world of the same
+// component types, built with any traits. Operations made through the
+// recorder are forwarded to the world and logged: entity creation and
+// destruction, component additions and removals (without their values) and
+// view iterations (one per view obtained here, which must be one of Views).
+// Everything else goes to world() unrecorded. A record is an op byte, the
+// component index (or the view's index in Views) and the entity, both as
+// varints.
+template <byte_sink Sink, typename Views, typename... Cs>
+struct trace_recorder {
+  inline trace_recorder(ecs<Cs...> &world, Sink &sink, Views,
+                        size_t buffer_bytes = 64 * 1024)
+      : _world(world), _sink(sink), _buffer_bytes(buffer_bytes) {
+    _buf.reserve(buffer_bytes + 32);
+    auto append = [&](const auto &v) {
+      const char *p = reinterpret_cast<const char *>(&v);
+      _buf.insert(_buf.end(), p, p + sizeof(v));
+    };
+    append(trace_magic);
+    append(trace_version);
+    append(_private::schema_hash<Cs...>());
+    append(_views_hash(Views{}));
   }
 
-  template <size_t... Is>
-  std::vector<entity> *_smallest_pool_impl(std::index_sequence<Is...>) {
-    constexpr size_t N = sizeof...(Is);
-    std::vector<entity> *sizes[N] = {&std::get<Is>(_pools).back...};
+  trace_recorder(const trace_recorder &) = delete;
+  trace_recorder &operator=(const trace_recorder &) = delete;
 
-    size_t min_size = sizes[0]->size();
-    std::vector<entity> *res = sizes[0];
-    for (size_t i = 1; i < N; ++i) {
-      if (sizes[i]->size() < min_size) {
-        min_size = sizes[i]->size();
-        res = sizes[i];
-      }
+  inline ~trace_recorder() { (void)flush(); }
+
+  [[nodiscard]] inline entity add_entity() {
+    const entity e = _world.add_entity();
+    _record(trace_op::create, 0, e);
+    return e;
+  }
+
+  inline void remove_entity(entity e) {
+    _world.remove_entity(e);
+    _record(trace_op::destroy, 0, e);
+  }
+
+  template <typename C, typename... Ts>
+  inline void add_component(entity e, Ts &&...ts) {
+    _world.template add_component<C>(e, std::forward<Ts>(ts)...);
+    _record(trace_op::add, _index<C>(), e);
+  }
+
+  template <typename C> inline void remove_component(entity e) {
+    _world.template remove_component<C>(e);
+    _record(trace_op::remove, _index<C>(), e);
+  }
+
+  template <typename... Vs> inline ::mm::ecs::view<Vs...> view() {
+    constexpr uint32_t index =
+        _private::trace_view_index<::mm::ecs::view<Vs...>>(Views{});
+    static_assert(index < _view_count(Views{}),
+                  "trace_recorder::view(): the view type is not listed in "
+                  "the recorder's trace_views");
+    _record(trace_op::view, index, 0);
+    return ::mm::ecs::view<Vs...>(_world);
+  }
+
+  inline ecs<Cs...> &world() { return _world; }
+
+  // Writes buffered records. Returns the first write failure since the last
+  // flush.
+  inline std::expected<void, error> flush() {
+    if (!_buf.empty()) {
+      _failed |= !_sink.write(_buf);
+      _buf.clear();
     }
-    return res;
+    if (_failed) {
+      _failed = false;
+      return std::unexpected(error::stream_io_failed);
+    }
+    return {};
   }
 
-  std::tuple<Ccs &...> _get_components(entity e) {
-    return _get_components_impl(e, std::index_sequence_for<Ccs...>{});
+  inline uint64_t records() const { return _records; }
+
+private:
+  template <typename C> constexpr static uint32_t _index() {
+    constexpr std::array<bool, sizeof...(Cs)> same = {
+        std::is_same_v<C, Cs>...};
+    return static_cast<uint32_t>(std::ranges::find(same, true) -
+                                 same.begin());
   }
 
-  template <std::size_t... I>
-  std::tuple<Ccs &...> _get_components_impl(entity e,
-                                            std::index_sequence<I...>) {
-    return std::forward_as_tuple(std::get<I>(_pools).get_element_fast(e)...);
+  template <typename... Vs>
+  constexpr static uint32_t _view_count(trace_views<Vs...>) {
+    return sizeof...(Vs);
+  }
+
+  template <typename... Vs>
+  inline static uint64_t _views_hash(trace_views<Vs...>) {
+    return _private::schema_hash<Vs...>();
+  }
+
+  inline void _record(trace_op op, uint32_t what, entity e) {
+    _buf.push_back(static_cast<char>(op));
+    _private::append_varint(_buf, what);
+    _private::append_varint(_buf, e);
+    ++_records;
+    if (_buf.size() >= _buffer_bytes) {
+      (void)flush();
+    }
+  }
+
+  ecs<Cs...> &_world;
+  Sink &_sink;
+  size_t _buffer_bytes;
+  std::vector<char> _buf = {};
+  uint64_t _records = 0;
+  bool _failed = false;
+};
+
+template <typename Sink, typename... Vs, typename... Cs>
+trace_recorder(ecs<Cs...> &, Sink &, trace_views<Vs...>, size_t = 0)
+    -> trace_recorder<Sink, trace_views<Vs...>, Cs...>;
+
+// Time spent replaying one kind of operation. Consecutive operations of the
+// same kind are timed together, so clock reads stay out of the measurement.
+struct trace_timing {
+  uint64_t count = 0;
+  double ns = 0;
+};
+
+struct trace_report {
+  std::array<trace_timing, 5> ops = {};
+  // Entities yielded by all view iterations, and a checksum of the
+  // components they read so the iterations cannot be optimised out.
+  uint64_t view_entities = 0;
+  uint64_t checksum = 0;
+
+  inline const trace_timing &operator[](trace_op op) const {
+    return ops[static_cast<size_t>(op)];
   }
 
-  std::tuple<_private::component_pool<Ccs> &...> _pools;
+  inline double total_ns() const {
+    double ns = 0;
+    for (const trace_timing &t : ops) {
+      ns += t.ns;
+    }
+    return ns;
+  }
 };
 
+// Re-executes a trace_recorder trace against world and reports how long each
+// kind of operation took. The whole trace is read and decoded first, so
+// parsing is not timed. Entities are mapped to the ids the world hands out;
+// ids the recording world already had are created on first use, and
+// operations on components that existed before the recording are skipped.
+// Added components are default constructed. Views must be the trace_views
+// the trace was recorded with; each recorded view is iterated as that view
+// type, and every component it yields is read.
+//
+//   std::ifstream in("frame.trace", std::ios::binary);
+//   ecs<position, velocity> w;  // built with the traits under test
+//   istream_source source{in};
+//   auto report = replay_trace(w, source, frame_views{});
+template <typename... Cs, byte_source Source, typename... Vs>
+inline std::expected<trace_report, error>
+replay_trace(ecs<Cs...> &world, Source &source, trace_views<Vs...>) {
+  std::vector<char> bytes;
+  constexpr size_t chunk = 64 * 1024;
+  while (true) {
+    const size_t at = bytes.size();
+    bytes.resize(at + chunk);
+    const size_t got = source.read(std::span<char>(bytes).subspan(at));
+    bytes.resize(at + got);
+    if (got < chunk) {
+      break;
+    }
+  }
+
+  uint32_t magic = 0, version = 0;
+  uint64_t schema = 0, views = 0;
+  if (bytes.size() < 24) {
+    return std::unexpected(error::stream_io_failed);
+  }
+  std::memcpy(&magic, bytes.data(), 4);
+  std::memcpy(&version, bytes.data() + 4, 4);
+  std::memcpy(&schema, bytes.data() + 8, 8);
+  std::memcpy(&views, bytes.data() + 16, 8);
+  if (magic != trace_magic || version != trace_version ||
+      schema != _private::schema_hash<Cs...>() ||
+      views != _private::schema_hash<Vs...>()) {
+    return std::unexpected(error::snapshot_incompatible);
+  }
+
+  struct record {
+    trace_op op;
+    uint32_t what;
+    entity e;
+  };
+  std::vector<record> records;
+  std::span<const char> in = std::span<const char>(bytes).subspan(24);
+  while (!in.empty()) {
+    const auto op = static_cast<uint8_t>(in.front());
+    in = in.subspan(1);
+    uint64_t what = 0, e = 0;
+    if (!_private::read_varint(in, what) || !_private::read_varint(in, e)) {
+      return std::unexpected(error::stream_io_failed);
+    }
+    const bool component = op == static_cast<uint8_t>(trace_op::add) ||
+                           op == static_cast<uint8_t>(trace_op::remove);
+    if (op > static_cast<uint8_t>(trace_op::view) ||
+        (component && what >= sizeof...(Cs)) ||
+        (op == static_cast<uint8_t>(trace_op::view) &&
+         what >= sizeof...(Vs)) ||
+        e >= invalid_entity) {
+      return std::unexpected(error::snapshot_incompatible);
+    }
+    records.push_back({static_cast<trace_op>(op), static_cast<uint32_t>(what),
+                       static_cast<entity>(e)});
+  }
+
+  trace_report report;
+  std::vector<entity> ids;
+  auto local = [&](entity e) {
+    if (e >= ids.size()) {
+      ids.resize(static_cast<size_t>(e) + 1, invalid_entity);
+    }
+    if (ids[e] == invalid_entity) {
+      ids[e] = world.add_entity();
+    }
+    return ids[e];
+  };
+
+  auto component = [&]<size_t... I>(std::index_sequence<I...>,
+                                    const record &r) {
+    auto one = [&]<typename C>() {
+      const entity e = local(r.e);
+      auto &pool = world.template pool_of<C>();
+      if (r.op == trace_op::add && !pool.has_component(e)) {
+        world.template add_component<C>(e);
+      } else if (r.op == trace_op::remove && pool.has_component(e)) {
+        world.template remove_component<C>(e);
+      }
+    };
+    ((I == r.what ? (one.template operator()<Cs>(), 0) : 0), ...);
+  };
+
+  // Components are only read, through const references.
+  auto walk = [&](uint32_t index) {
+    auto read = [&](const auto &c) {
+      report.checksum += *reinterpret_cast<const unsigned char *>(&c);
+    };
+    auto one = [&]<typename V>() {
+      for (auto [e, v] : V(world)) {
+        ++report.view_entities;
+        std::apply([&](const auto &...c) { (read(c), ...); }, v);
+      }
+    };
+    uint32_t i = 0;
+    ((i++ == index ? one.template operator()<Vs>() : void()), ...);
+  };
+
+  for (size_t i = 0; i < records.size();) {
+    const trace_op op = records[i].op;
+    const auto start = std::chrono::steady_clock::now();
+    size_t j = i;
+    for (; j < records.size() && records[j].op == op; ++j) {
+      const record &r = records[j];
+      switch (op) {
+      case trace_op::create:
+        if (r.e >= ids.size()) {
+          ids.resize(static_cast<size_t>(r.e) + 1, invalid_entity);
+        }
+        ids[r.e] = world.add_entity();
+        break;
+      case trace_op::destroy:
+        world.remove_entity(local(r.e));
+        ids[r.e] = invalid_entity;
+        break;
+      case trace_op::add:
+      case trace_op::remove:
+        component(std::index_sequence_for<Cs...>{}, r);
+        break;
+      case trace_op::view:
+        walk(r.what);
+        break;
+      }
+    }
+    trace_timing &t = report.ops[static_cast<size_t>(op)];
+    t.count += j - i;
+    t.ns += std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+    i = j;
+  }
+  return report;
+}
+
 }; // namespace ecs
 } // namespace mm
@@ -1,9 +1,21 @@
 #include "ecs.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <numeric>
 #include <print>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 struct v3 {
@@ -12,7 +24,65 @@ struct v3 {
 
 using test_data = std::array<int, 20>;
 
-[[noreturn]] int main() {
+struct velocity {
+  float x, y, z;
+};
+
+template <>
+struct mm::ecs::component_traits<velocity>
+    : mm::ecs::default_component_traits {
+  constexpr static bool double_buffered = true;
+};
+
+struct health {
+  int hp;
+};
+
+template <>
+struct mm::ecs::component_traits<health> : mm::ecs::default_component_traits {
+  constexpr static pool_storage storage = pool_storage::mapped;
+};
+
+struct position {
+  float x, y;
+};
+
+template <>
+struct mm::ecs::component_traits<position>
+    : mm::ecs::default_component_traits {
+  constexpr static pool_storage storage = pool_storage::copy_on_write;
+};
+
+struct label {
+  std::string text;
+};
+
+struct flags {
+  bool on;
+  int level;
+};
+
+struct sample {
+  float v[3];
+  int k;
+};
+
+template <> struct mm::ecs::serializer<label> {
+  static void save(std::ostream &os, const label &l) {
+    const uint32_t n = static_cast<uint32_t>(l.text.size());
+    os.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    os.write(l.text.data(), n);
+  }
+  static label load(std::istream &is) {
+    uint32_t n = 0;
+    is.read(reinterpret_cast<char *>(&n), sizeof(n));
+    label l{std::string(is ? n : 0, '\0')};
+    is.read(l.text.data(), static_cast<std::streamsize>(l.text.size()));
+    return l;
+  }
+};
+
+int main() {
   using namespace mm::ecs;
   using namespace std::chrono;
 
@@ -137,6 +207,69 @@ using test_data = std::array<int, 20>;
                  duration<double>(end_view - start_view).count(), (float)sink);
   }
 
+  // ---------------- SINGLE COMPONENT VIEW ----------------
+  {
+    std::println("Testing single component view");
+    auto start_view = steady_clock::now();
+    size_t count = 0;
+    volatile float sink = 0.0f;
+    for (auto [e, v] : view<v3>(ecs)) {
+      count++;
+      auto &[val] = v;
+      sink += val.x;
+    }
+    auto end_view = steady_clock::now();
+    view<v3> positions(ecs);
+    assert(count == positions.size());
+    assert(positions.components().size() == positions.entities().size());
+    std::println("Iterated over {} v3 components in {:.6f} s (sink = {})",
+                 count, duration<double>(end_view - start_view).count(),
+                 (float)sink);
+  }
+
+  // ---------------- VIEW PREFETCH AFTER CHURN ----------------
+  {
+    std::println("Testing view prefetch on churned pools");
+    // Re-adding components in random order leaves both pools' dense arrays
+    // permuted relative to entity ids, so every lookup is a random access.
+    std::vector<entity> order;
+    for (const auto &[e, i] : entities) {
+      if (ecs.has_component<test_data>(e)) {
+        order.push_back(e);
+      }
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937{1234});
+    for (entity e : order) {
+      test_data t = ecs.get_component<test_data>(e);
+      ecs.remove_component<test_data>(e);
+      ecs.add_component<test_data>(e, t);
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937{4321});
+    for (entity e : order) {
+      v3 v = ecs.get_component<v3>(e);
+      ecs.remove_component<v3>(e);
+      ecs.add_component<v3>(e, v);
+    }
+
+    auto run = [&](size_t distance) {
+      auto start = steady_clock::now();
+      size_t count = 0;
+      volatile float sink = 0.0f;
+      for (auto [e, v] : view<test_data, v3>(ecs, distance)) {
+        count++;
+        auto &[data, val] = v;
+        sink += val.x + static_cast<float>(data[0]);
+      }
+      auto end = steady_clock::now();
+      std::println("  prefetch distance {:2}: {} entities in {:.6f} s",
+                   distance, count, duration<double>(end - start).count());
+      return count;
+    };
+    [[maybe_unused]] size_t without = run(0);
+    [[maybe_unused]] size_t with = run(default_prefetch_distance);
+    assert(without == with);
+  }
+
   // ---------------- SMART REF FUNCTIONAL TEST ----------------
   {
     std::println("Testing smart_ref correctness and performance");
@@ -232,6 +365,1433 @@ using test_data = std::array<int, 20>;
         duration<double>(end_perf - start_perf).count(), (float)sink);
   }
 
+  // ---------------- SMART REF REFCOUNT POLICIES ----------------
+  {
+    std::println("Benchmarking plain vs atomic smart_ref refcounts");
+    auto &pool = ecs.pool_of<v3>();
+    auto churn = [&]<refcount_policy R>() {
+      auto start = steady_clock::now();
+      for (entity e : pool.back) {
+        smart_ref<v3, R> a(&pool, e);
+        smart_ref<v3, R> b = a;
+        smart_ref<v3, R> c = b;
+      }
+      return duration<double>(steady_clock::now() - start).count();
+    };
+    double plain = churn.template operator()<refcount_policy::plain>();
+    double atomic = churn.template operator()<refcount_policy::atomic>();
+    std::println("  {} x 3 refs: plain {:.6f} s, atomic {:.6f} s",
+                 pool.back.size(), plain, atomic);
+
+    // Atomic refs to one component from several threads must balance out.
+    entity shared = pool.back.front();
+    {
+      std::vector<std::jthread> holders;
+      for (int t = 0; t < 4; t++) {
+        holders.emplace_back([&] {
+          smart_ref<v3, refcount_policy::atomic> r(&pool, shared);
+          for (int i = 0; i < 100'000; i++) {
+            smart_ref<v3, refcount_policy::atomic> copy = r;
+          }
+        });
+      }
+    }
+    assert(pool.refcounts[pool.forward[shared]] == 0);
+  }
+
+  // ---------------- COMPONENT SIGNAL TEST ----------------
+  {
+    std::println("Testing component lifecycle signals");
+    mm::ecs::ecs<v3> w;
+    size_t constructed = 0, updated = 0, destroyed = 0;
+    auto c1 = w.on_construct<v3>().connect(
+        [&](entity, v3 &v) { constructed += v.x == 1.0f; });
+    auto c2 = w.on_update<v3>().connect(
+        [&](entity, v3 &v) { updated += v.x == 2.0f; });
+    auto c3 = w.on_destroy<v3>().connect([&](entity e, v3 &) {
+      destroyed += w.has_component<v3>(e);
+    });
+
+    entity a = w.add_entity();
+    w.add_component<v3>(a, v3{1.0f, 0.0f, 0.0f});
+    w.replace_component<v3>(a, v3{2.0f, 0.0f, 0.0f});
+    w.patch_component<v3>(a, [](v3 &v) { v.y = 1.0f; });
+    w.remove_entity(a);
+    assert(constructed == 1 && updated == 2 && destroyed == 1);
+
+    w.on_construct<v3>().disconnect(c1);
+    w.on_update<v3>().disconnect(c2);
+    w.on_destroy<v3>().disconnect(c3);
+    w.add_component<v3>(w.add_entity(), v3{1.0f, 0.0f, 0.0f});
+    assert(constructed == 1);
+  }
+
+  // ---------------- SPATIAL GRID TEST ----------------
+  {
+    std::println("Testing spatial grid queries");
+    mm::ecs::ecs<v3> w;
+    spatial_grid<v3> grid(w, 4.0f);
+    std::mt19937 rng{99};
+    std::uniform_real_distribution<float> coord(-100.0f, 100.0f);
+    for (int i = 0; i < 10'000; i++) {
+      w.add_component<v3>(w.add_entity(),
+                          v3{coord(rng), coord(rng), coord(rng)});
+    }
+    w.remove_entity(7);
+    w.replace_component<v3>(8, v3{1.0f, 1.0f, 1.0f});
+    assert(grid.size() == 9'999);
+
+    auto brute = [&](float r) {
+      size_t n = 0;
+      for (auto [e, v] : view<v3>(w)) {
+        auto &[p] = v;
+        n += p.x * p.x + p.y * p.y + p.z * p.z <= r * r;
+      }
+      return n;
+    };
+    [[maybe_unused]] auto near = grid.query_radius({0.0f, 0.0f, 0.0f}, 20.0f);
+    assert(near.size() == brute(20.0f));
+    assert(grid.query_radius({0.0f, 0.0f, 0.0f}, 500.0f).size() == 9'999);
+    assert(grid.query_box({0.5f, 0.5f, 0.5f}, {1.5f, 1.5f, 1.5f}).size() >= 1);
+  }
+
+  // ---------------- SECONDARY INDEX TEST ----------------
+  {
+    std::println("Testing secondary indexes");
+    struct team {
+      int id;
+    };
+    auto by_id = [](const team &t) { return t.id; };
+    mm::ecs::ecs<team> w;
+    for (int i = 0; i < 1000; i++) {
+      w.add_component<team>(w.add_entity(), team{i % 10});
+    }
+    hash_index<team, decltype(by_id)> teams(w, by_id);
+    ordered_index<team, decltype(by_id)> ordered(w, by_id);
+
+    // Removal swap-and-pops the pool; both indexes must stay consistent.
+    for (entity e = 0; e < 1000; e += 3) {
+      w.remove_entity(e);
+    }
+    w.replace_component<team>(1, team{42});
+    for (int id = 0; id < 10; id++) {
+      for ([[maybe_unused]] entity e : teams.find(id)) {
+        assert(w.get_component<team>(e).id == id);
+      }
+    }
+    assert(teams.count(42) == 1 && teams.find(42)[0] == 1);
+    assert(ordered.size() == w.pool_of<team>().data.size());
+    size_t in_range = 0;
+    [[maybe_unused]] int last = -1;
+    for (entity e : ordered.range(3, 5)) {
+      int id = w.get_component<team>(e).id;
+      assert(id >= 3 && id <= 5 && id >= last);
+      last = id;
+      in_range++;
+    }
+    assert(in_range == teams.count(3) + teams.count(4) + teams.count(5));
+  }
+
+  // ---------------- SYSTEM SCHEDULER TEST ----------------
+  {
+    std::println("Testing parallel system scheduler");
+    using world_t = mm::ecs::ecs<v3, test_data>;
+    world_t w;
+    for (int i = 0; i < 10'000; i++) {
+      entity e = w.add_entity();
+      w.add_component<v3>(e, v3{1.0f, 0.0f, 0.0f});
+      w.add_component<test_data>(e, test_data{});
+    }
+    thread_pool workers(4);
+    system_scheduler<v3, test_data> systems(w, workers);
+    std::atomic<size_t> moved = 0, counted = 0;
+    systems.add_system<writes<v3>>([&](auto &ctx) {
+      for (auto [e, v] : ctx.template view<v3>()) {
+        std::get<0>(v).x += 1.0f;
+        moved++;
+      }
+    });
+    systems.add_system<writes<test_data>>([&](auto &ctx) {
+      for (auto [e, v] : ctx.template view<test_data>()) {
+        std::get<0>(v)[0] += 1;
+      }
+    });
+    // Reads v3 after the writer above, by registration order.
+    systems.add_system<reads<v3, test_data>>([&](auto &ctx) {
+      for (auto [e, v] : ctx.template view<v3, test_data>()) {
+        auto &[p, d] = v;
+        counted += p.x == 2.0f && d[0] == 1;
+      }
+    });
+    systems.run();
+    assert(moved == 10'000 && counted == 10'000);
+
+    // Systems that only read may share a pool: their views hand out const
+    // references, and neither those nor read() and has() record anything.
+    w.track_changes();
+    system_scheduler<v3, test_data> readers(w, workers);
+    std::atomic<size_t> seen = 0;
+    for (int k = 0; k < 2; k++) {
+      readers.add_system<reads<v3>>([&](auto &ctx) {
+        for (auto [e, v] : ctx.template view<v3>()) {
+          const auto &p = std::get<0>(v);
+          static_assert(std::is_const_v<std::remove_reference_t<decltype(p)>>);
+          seen += ctx.template has<v3>(e) && ctx.template read<v3>(e).x == p.x;
+        }
+      });
+    }
+    readers.run();
+    assert(seen == 20'000 && w.pool_of<v3>().changes.changed.empty());
+
+    // A throwing job surfaces on the caller once every job has finished.
+    std::atomic<size_t> ran = 0;
+    bool caught = false;
+    try {
+      workers.parallel_for(8, [&](size_t i) {
+        ran++;
+        if (i == 3) {
+          throw std::runtime_error("job failed");
+        }
+      });
+    } catch (const std::runtime_error &) {
+      caught = true;
+    }
+    assert(caught && ran == 8);
+  }
+
+  // ---------------- COMMAND BUFFER TEST ----------------
+  {
+    std::println("Testing command buffers");
+    mm::ecs::ecs<v3, test_data> w;
+    for (int i = 0; i < 1000; i++) {
+      w.add_component<v3>(w.add_entity(), v3{0.0f, 0.0f, 0.0f});
+    }
+    // Structural changes recorded mid-iteration are safe to make afterwards.
+    command_buffer<v3, test_data> cmds;
+    for (auto [e, v] : view<v3>(w)) {
+      if (e % 2 == 0) {
+        cmds.add_component<test_data>(e, test_data{});
+      } else if (e % 3 == 0) {
+        cmds.remove_entity(e);
+      } else {
+        cmds.remove_component<v3>(e);
+        cmds.add_component<v3>(e, v3{1.0f, 1.0f, 1.0f});
+      }
+    }
+    [[maybe_unused]] auto res = cmds.apply(w);
+    assert(res && cmds.empty());
+    assert(w.pool_of<test_data>().data.size() == 500);
+    assert(!w.has_component<v3>(3) && w.get_component<v3>(5).x == 1.0f);
+  }
+
+  // ---------------- CONCURRENT ENTITY CREATION ----------------
+  {
+    std::println("Testing concurrent entity creation");
+    mm::ecs::ecs<v3, test_data> w;
+    constexpr size_t THREADS = 4, PER_THREAD = 10'000;
+    std::vector<command_buffer<v3, test_data>> buffers(THREADS);
+    {
+      std::vector<std::jthread> spawners;
+      for (size_t t = 0; t < THREADS; t++) {
+        spawners.emplace_back([&, t] {
+          for (size_t i = 0; i < PER_THREAD; i++) {
+            entity e = buffers[t].create_entity(w);
+            buffers[t].add_component<v3>(e, v3{float(t), 0.0f, 0.0f});
+          }
+        });
+      }
+    }
+    for (auto &b : buffers) {
+      [[maybe_unused]] auto res = b.apply(w);
+      assert(res);
+    }
+    auto &pool = w.pool_of<v3>();
+    assert(pool.data.size() == THREADS * PER_THREAD);
+    std::vector<entity> ids(pool.back.begin(), pool.back.end());
+    std::sort(ids.begin(), ids.end());
+    assert(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+    [[maybe_unused]] auto removed =
+        w.remove_entity<safety_policy::checked>(ids.front());
+    assert(removed);
+  }
+
+  // ---------------- STAGED POOL MERGE ----------------
+  {
+    std::println("Testing staged pool merge");
+    mm::ecs::ecs<v3, test_data> w;
+    constexpr size_t THREADS = 4, PER_THREAD = 50'000;
+    entity first = w.reserve_entities(THREADS * PER_THREAD);
+    std::vector<entity> ids(THREADS * PER_THREAD);
+    std::iota(ids.begin(), ids.end(), first);
+    w.commit_entities(ids);
+    w.add_component<v3>(first, v3{});
+
+    thread_pool workers(THREADS);
+    std::vector<staging_pool<v3>> stages(THREADS);
+    workers.parallel_for(THREADS, [&](size_t t) {
+      // Entity `first` already has a v3 and is skipped.
+      for (size_t i = t * PER_THREAD; i < (t + 1) * PER_THREAD; i++) {
+        if (i != 0) {
+          stages[t].add(first + entity(i), v3{float(i), 0.0f, 0.0f});
+        }
+      }
+    });
+    auto start = steady_clock::now();
+    w.merge_staged<v3>(std::span(stages), workers);
+    auto end = steady_clock::now();
+    auto &pool = w.pool_of<v3>();
+    assert(pool.data.size() == THREADS * PER_THREAD);
+    for ([[maybe_unused]] entity e : ids) {
+      assert(w.get_component<v3>(e).x == float(e - first));
+    }
+
+    // A second merge that collides with an existing component is rejected.
+    stages[0].add(first + 1, v3{});
+    [[maybe_unused]] auto res =
+        w.merge_staged<v3, safety_policy::checked>(std::span(stages), workers);
+    assert(!res && w.get_component<v3>(first + 1).x == 1.0f);
+    std::println("Merged {} staged components in {:.6f} s",
+                 pool.data.size() - 1, duration<double>(end - start).count());
+  }
+
+  // ---------------- COROUTINE TASKS ----------------
+  {
+    std::println("Testing coroutine tasks");
+    using world_t = mm::ecs::ecs<v3, test_data>;
+    world_t w;
+    task_scheduler<v3, test_data> tasks(w);
+    entity e = w.add_entity();
+    std::vector<std::pair<int, uint64_t>> log;
+
+    auto waiter = [](task_scheduler<v3, test_data> &s, entity e,
+                     std::vector<std::pair<int, uint64_t>> &log) -> task {
+      co_await s.wait_frames(3);
+      log.emplace_back(1, s.frame());
+      v3 &pos = co_await s.wait_for<v3>(e);
+      log.emplace_back(2, s.frame());
+      pos.x = 5.0f;
+    };
+    tasks.spawn(waiter(tasks, e, log));
+    for (int i = 0; i < 10; i++) {
+      if (i == 6) {
+        w.add_component<v3>(e, v3{});
+      }
+      tasks.tick();
+    }
+    assert(log.size() == 2 && log[0] == std::pair(1, uint64_t{4}));
+    assert(log[1] == std::pair(2, uint64_t{7}));
+    assert(tasks.size() == 0 && w.get_component<v3>(e).x == 5.0f);
+
+    // A component removed again before the tick does not wake the waiter.
+    bool resumed = false;
+    auto flag = [](task_scheduler<v3, test_data> &s, entity e,
+                   bool &resumed) -> task {
+      test_data &d = co_await s.wait_for<test_data>(e);
+      resumed = d[0] == 7;
+    };
+    tasks.spawn(flag(tasks, e, resumed));
+    tasks.tick();
+    w.add_component<test_data>(e, test_data{1});
+    w.remove_component<test_data>(e);
+    tasks.tick();
+    assert(!resumed && tasks.size() == 1);
+    w.add_component<test_data>(e, test_data{7});
+    tasks.tick();
+    assert(resumed && tasks.size() == 0);
+  }
+
+  // ---------------- DOUBLE-BUFFERED COMPONENTS ----------------
+  {
+    std::println("Testing double-buffered components");
+    mm::ecs::ecs<v3, velocity> w;
+    for (int i = 0; i < 100; i++) {
+      entity e = w.add_entity();
+      w.add_component<velocity>(e, velocity{float(i), 0.0f, 0.0f});
+      w.add_component<v3>(e, v3{});
+    }
+    // Writers go through views and get_component; readers keep seeing the
+    // last published frame until the swap.
+    for (auto [e, v] : view<v3, velocity>(w)) {
+      std::get<1>(v).y = 1.0f;
+    }
+    w.get_component<velocity>(3).z = 2.0f;
+    assert(w.read_component<velocity>(3).y == 0.0f);
+    w.swap_buffers();
+    assert(w.read_component<velocity>(3).y == 1.0f);
+    assert(w.read_component<velocity>(3).z == 2.0f);
+
+    // Untouched slots stay correct across several swaps, and removals keep
+    // both buffers aligned.
+    w.remove_entity(0);
+    w.get_component<velocity>(5).x = 50.0f;
+    w.swap_buffers();
+    w.swap_buffers();
+    assert(w.read_component<velocity>(5).x == 50.0f);
+    assert(w.get_component<velocity>(5).x == 50.0f);
+    for ([[maybe_unused]] auto [e, v] : view<velocity>(w)) {
+      assert(w.read_component<velocity>(e).x == float(e) || e == 5);
+      assert(std::get<0>(v).y == 1.0f);
+    }
+
+    // Views mark only the slots they hand out mutably, so the next swap
+    // catches up on those instead of copying the whole pool.
+    w.swap_buffers();
+    for (entity e = 1; e < 100; e += 2) {
+      w.remove_component<v3>(e);
+    }
+    [[maybe_unused]] float read = 0.0f;
+    for (auto [e, v] : view<const velocity>(w)) {
+      read += std::get<0>(v).x;
+    }
+    for (auto [e, v] : view<v3, const velocity>(w)) {
+      read += std::get<1>(v).x;
+    }
+    const auto &buffers = w.pool_of<velocity>().previous;
+    assert(buffers.dirty.empty() && !buffers.all_dirty);
+    [[maybe_unused]] size_t written = 0;
+    for (auto [e, v] : view<v3, velocity>(w)) {
+      std::get<1>(v).z = 3.0f;
+      written++;
+    }
+    assert(written == 49 && buffers.dirty.size() == written);
+    assert(!buffers.all_dirty);
+    w.swap_buffers();
+    assert(w.read_component<velocity>(2).z == 3.0f);
+    assert(w.read_component<velocity>(7).z == 0.0f);
+  }
+
+  // ---------------- SHARDED WORLDS ----------------
+  {
+    std::println("Testing sharded worlds");
+    thread_pool workers(4);
+    sharded_ecs<v3, test_data> world(4, workers);
+    std::vector<entity> spawned;
+    for (size_t s = 0; s < world.shard_count(); s++) {
+      for (int i = 0; i < 1000; i++) {
+        entity e = world.add_entity(s);
+        world.add_component<v3>(e, v3{float(i), 0.0f, 0.0f});
+        if (i % 2 == 0) {
+          world.add_component<test_data>(e, test_data{i});
+        }
+        spawned.push_back(e);
+      }
+    }
+    assert(world.shard_of(spawned[1500]) == 1);
+
+    // Move every even entity of shard 1 into shard 3.
+    std::vector<entity> leaving;
+    for (size_t i = 1000; i < 2000; i += 2) {
+      leaving.push_back(spawned[i]);
+    }
+    std::vector<entity> arrived = world.migrate(leaving, 3);
+    for (size_t k = 0; k < arrived.size(); k++) {
+      assert(world.shard_of(arrived[k]) == 3);
+      assert(world.get_component<v3>(arrived[k]).x == float(2 * k));
+      assert(world.get_component<test_data>(arrived[k])[0] == int(2 * k));
+    }
+    assert(world.shard(1).pool_of<v3>().data.size() == 500);
+    assert(world.shard(1).pool_of<test_data>().data.size() == 0);
+    assert(world.shard(3).pool_of<v3>().data.size() == 1500);
+
+    std::atomic<size_t> matched = 0;
+    world.for_each<v3, test_data>([&](entity, v3 &, test_data &) {
+      matched++;
+    });
+    assert(matched == 2000);
+  }
+
+  // ---------------- SNAPSHOTS ----------------
+  {
+    std::println("Testing snapshots");
+    using world_t = mm::ecs::ecs<v3, test_data, velocity, label>;
+    world_t w;
+    for (int i = 0; i < 200'000; i++) {
+      entity e = w.add_entity();
+      w.add_component<v3>(e, v3{float(i), 1.0f, 2.0f});
+      if (i % 3 == 0) {
+        w.add_component<test_data>(e, test_data{i});
+      }
+      if (i % 5 == 0) {
+        w.add_component<velocity>(e, velocity{0.0f, float(i), 0.0f});
+      }
+      if (i % 1000 == 0) {
+        w.add_component<label>(e, label{std::to_string(i)});
+      }
+    }
+    for (entity e = 0; e < 200'000; e += 7) {
+      w.remove_entity(e);
+    }
+
+    std::stringstream buf;
+    auto start = high_resolution_clock::now();
+    [[maybe_unused]] auto saved = w.save(buf);
+    auto mid = high_resolution_clock::now();
+    world_t restored;
+    [[maybe_unused]] auto loaded = restored.load(buf);
+    auto stop = high_resolution_clock::now();
+    assert(saved && loaded);
+    std::println("Saved {} bytes in {} ms, loaded in {} ms", buf.str().size(),
+                 duration_cast<milliseconds>(mid - start).count(),
+                 duration_cast<milliseconds>(stop - mid).count());
+
+    for (entity e = 0; e < 200'000; e++) {
+      assert(w.has_component<v3>(e) == restored.has_component<v3>(e));
+      assert(w.has_component<label>(e) == restored.has_component<label>(e));
+      if (w.has_component<v3>(e)) {
+        assert(restored.get_component<v3>(e).x == float(e));
+      }
+      if (w.has_component<test_data>(e)) {
+        assert(restored.get_component<test_data>(e)[0] == int(e));
+      }
+      if (w.has_component<label>(e)) {
+        assert(restored.get_component<label>(e).text == std::to_string(e));
+      }
+      if (w.has_component<velocity>(e)) {
+        assert(restored.read_component<velocity>(e).y == float(e));
+      }
+    }
+    [[maybe_unused]] entity next = restored.add_entity();
+    [[maybe_unused]] entity expected = w.add_entity();
+    assert(next == expected);
+
+    // A truncated snapshot fails and leaves the target as it was.
+    std::string bytes = buf.str();
+    std::stringstream truncated(bytes.substr(0, bytes.size() / 2));
+    [[maybe_unused]] auto cut = restored.load(truncated);
+    assert(cut.error() == error::snapshot_io_failed);
+    assert(restored.get_component<v3>(1).x == 1.0f);
+
+    std::stringstream full(bytes);
+    mm::ecs::ecs<v3, test_data, label, velocity> reordered;
+    [[maybe_unused]] auto mismatched = reordered.load(full);
+    assert(mismatched.error() == error::snapshot_incompatible);
+
+    // Indices attached to the target follow the loaded contents.
+    mm::ecs::ecs<v3, velocity> seed;
+    for (int i = 0; i < 4; i++) {
+      seed.add_component<v3>(seed.add_entity(), v3{float(i), 0.0f, 0.0f});
+    }
+    std::stringstream image;
+    [[maybe_unused]] auto seed_saved = seed.save(image);
+    assert(seed_saved);
+    mm::ecs::ecs<v3, velocity> target;
+    target.add_component<v3>(target.add_entity(), v3{50.0f, 0.0f, 0.0f});
+    spatial_grid<v3> grid(target, 4.0f);
+    [[maybe_unused]] auto seed_loaded = target.load(image);
+    assert(seed_loaded);
+    assert(grid.query_radius({50.0f, 0.0f, 0.0f}, 1.0f).empty());
+    assert(grid.query_radius({0.0f, 0.0f, 0.0f}, 10.0f).size() == 4);
+  }
+
+  // ---------------- DELTA SNAPSHOTS ----------------
+  {
+    std::println("Testing delta snapshots");
+    using world_t = mm::ecs::ecs<v3, velocity, label>;
+    world_t w;
+    for (int i = 0; i < 100'000; i++) {
+      entity e = w.add_entity();
+      w.add_component<v3>(e, v3{float(i), 0.0f, 0.0f});
+      if (i % 4 == 0) {
+        w.add_component<velocity>(e, velocity{1.0f, 0.0f, 0.0f});
+      }
+    }
+    w.track_changes();
+    std::stringstream base;
+    [[maybe_unused]] auto saved = w.save(base);
+    assert(saved);
+
+    // First delta: a handful of writes, additions and removals.
+    w.get_component<v3>(10).y = 5.0f;
+    w.patch_component<v3>(20, [](v3 &p) { p.z = 7.0f; });
+    w.add_component<label>(30, label{"thirty"});
+    w.remove_component<v3>(40);
+    w.remove_entity(50);
+    entity fresh = w.add_entity();
+    w.add_component<v3>(fresh, v3{-1.0f, 0.0f, 0.0f});
+    entity transient = w.add_entity();
+    w.remove_entity(transient);
+    std::stringstream d1;
+    [[maybe_unused]] auto first = w.save_delta(d1);
+    assert(first);
+    assert(d1.str().size() < base.str().size() / 100);
+
+    // Second delta: a view writing every velocity sends each of them.
+    for (auto [e, c] : view<velocity>(w)) {
+      std::get<0>(c).y += 1.0f;
+    }
+    w.remove_component<label>(30);
+    w.add_component<v3>(40, v3{40.0f, 1.0f, 1.0f});
+    std::stringstream d2;
+    [[maybe_unused]] auto second = w.save_delta(d2);
+    assert(second);
+
+    // Read-only views record nothing, so their delta is as small as one
+    // taken with no changes at all.
+    [[maybe_unused]] float read = 0.0f;
+    for (auto [e, c] : view<const velocity>(w)) {
+      read += std::get<0>(c).y;
+    }
+    for (auto [e, c] : view<const v3, const velocity>(w)) {
+      read += std::get<1>(c).y;
+    }
+    assert(w.pool_of<velocity>().changes.changed.empty());
+    std::stringstream quiet, idle;
+    [[maybe_unused]] auto saved_quiet = w.save_delta(quiet);
+    [[maybe_unused]] auto saved_idle = w.save_delta(idle);
+    assert(saved_quiet && saved_idle);
+    assert(quiet.str().size() == idle.str().size());
+
+    world_t r;
+    [[maybe_unused]] auto loaded = r.load(base);
+    assert(loaded);
+    std::stringstream d2_copy(d2.str());
+    [[maybe_unused]] auto skipped = r.apply_delta(d2_copy);
+    assert(skipped.error() == error::snapshot_incompatible);
+    [[maybe_unused]] auto applied_first = r.apply_delta(d1);
+    [[maybe_unused]] auto applied_second = r.apply_delta(d2);
+    assert(applied_first && applied_second);
+
+    for (entity e = 0; e < 100'002; e++) {
+      assert(w.has_component<v3>(e) == r.has_component<v3>(e));
+      assert(w.has_component<velocity>(e) == r.has_component<velocity>(e));
+      assert(w.has_component<label>(e) == r.has_component<label>(e));
+      if (w.has_component<v3>(e)) {
+        const v3 &a = w.get_component<v3>(e), &b = r.get_component<v3>(e);
+        assert(a.x == b.x && a.y == b.y && a.z == b.z);
+      }
+      if (w.has_component<velocity>(e)) {
+        assert(w.get_component<velocity>(e).y ==
+               r.get_component<velocity>(e).y);
+      }
+    }
+    assert(!r.has_component<v3>(50) && r.get_component<v3>(fresh).x == -1.0f);
+    [[maybe_unused]] entity next = r.add_entity();
+    [[maybe_unused]] entity expected = w.add_entity();
+    assert(next == expected);
+  }
+
+  // ---------------- CHANGE STREAM ----------------
+  {
+    std::println("Testing change stream");
+    using world_t = mm::ecs::ecs<v3, label>;
+    int fds[2];
+    [[maybe_unused]] int piped = ::pipe(fds);
+    assert(piped == 0);
+
+    constexpr int EVENTS_ENTITIES = 200'000;
+    world_t source;
+    world_t replica;
+    std::expected<uint64_t, error> applied;
+    auto start = high_resolution_clock::now();
+    std::thread reader([&] {
+      fd_source in{fds[0]};
+      change_applier<v3, label> applier;
+      applied = applier.apply_all(replica, in);
+    });
+
+    uint64_t sent = 0;
+    {
+      fd_sink out{fds[1]};
+      change_stream stream(source, out);
+      for (int i = 0; i < EVENTS_ENTITIES; i++) {
+        entity e = source.add_entity();
+        source.add_component<v3>(e, v3{float(i), 0.0f, 0.0f});
+        if (i % 100 == 0) {
+          source.add_component<label>(e, label{std::to_string(i)});
+        }
+      }
+      for (entity e = 0; e < EVENTS_ENTITIES; e += 3) {
+        source.patch_component<v3>(e, [](v3 &p) { p.y = 1.0f; });
+      }
+      std::vector<entity> doomed;
+      for (entity e = 0; e < EVENTS_ENTITIES; e += 50) {
+        doomed.push_back(e);
+      }
+      source.remove_entities(doomed);
+      [[maybe_unused]] auto flushed = stream.flush();
+      assert(flushed);
+      sent = stream.events();
+    }
+    ::close(fds[1]);
+    reader.join();
+    ::close(fds[0]);
+    auto stop = high_resolution_clock::now();
+
+    assert(applied.has_value() && *applied == sent);
+    const double secs = duration<double>(stop - start).count();
+    std::println("Streamed {} events through a pipe at {:.1f} M events/s",
+                 sent, double(sent) / secs / 1e6);
+
+    for (entity e = 0; e < EVENTS_ENTITIES; e++) {
+      assert(source.has_component<v3>(e) == replica.has_component<v3>(e));
+      assert(source.has_component<label>(e) ==
+             replica.has_component<label>(e));
+      if (source.has_component<v3>(e)) {
+        assert(replica.get_component<v3>(e).x == float(e));
+        assert(replica.get_component<v3>(e).y == (e % 3 == 0 ? 1.0f : 0.0f));
+      }
+      if (source.has_component<label>(e)) {
+        assert(replica.get_component<label>(e).text == std::to_string(e));
+      }
+    }
+    [[maybe_unused]] entity next = replica.add_entity();
+    [[maybe_unused]] entity expected = source.add_entity();
+    assert(next == expected);
+
+    // A corrupted event kind is rejected rather than read as a component.
+    std::stringstream bytes;
+    {
+      world_t small;
+      ostream_sink out{bytes};
+      change_stream stream(small, out);
+      small.add_component<v3>(small.add_entity(), v3{1.0f, 2.0f, 3.0f});
+      [[maybe_unused]] auto flushed = stream.flush();
+      assert(flushed);
+    }
+    std::string batch = bytes.str();
+    assert(batch.size() > 28);
+    batch[28] = char(9);
+    std::stringstream corrupt(batch);
+    istream_source in{corrupt};
+    world_t target;
+    change_applier<v3, label> applier;
+    [[maybe_unused]] auto rejected = applier.apply_batch(target, in);
+    assert(!rejected && rejected.error() == error::snapshot_incompatible);
+    assert(!target.has_component<v3>(0));
+  }
+
+  // ---------------- WORLD FORKING ----------------
+  {
+    std::println("Testing world forking");
+    mm::ecs::ecs<position, v3> w;
+    for (int i = 0; i < ENTITY_COUNT; i++) {
+      entity e = w.add_entity();
+      w.add_component<position>(e, position{float(i), 0.0f});
+    }
+    w.add_component<v3>(100, v3{100.0f, 0.0f, 0.0f});
+
+    auto start = high_resolution_clock::now();
+    auto child = w.fork();
+    auto stop = high_resolution_clock::now();
+    std::println("Forked a {} entity world in {} us", ENTITY_COUNT,
+                 duration_cast<microseconds>(stop - start).count());
+    assert(child.pool_of<position>().data.shares_with(
+        w.pool_of<position>().data));
+
+    // Reads leave the arrays shared; the first write copies them.
+    assert(child.has_component<position>(10));
+    assert(child.pool_of<position>().data.shares_with(
+        w.pool_of<position>().data));
+    child.get_component<position>(10).y = 1.0f;
+    assert(!child.pool_of<position>().data.shares_with(
+        w.pool_of<position>().data));
+    // Writing a value copies only the data array.
+    assert(child.pool_of<position>().back.shares_with(
+        w.pool_of<position>().back));
+    assert(child.pool_of<position>().forward.shares_with(
+        w.pool_of<position>().forward));
+    assert(w.get_component<position>(10).y == 0.0f);
+
+    // Views only take the data array for writing, so a fork iterated by any
+    // view keeps sharing back and forward with its parent.
+    {
+      auto viewer = w.fork();
+      [[maybe_unused]] size_t seen = 0;
+      for ([[maybe_unused]] auto [e, v] : view<position, v3>(viewer)) {
+        assert(e == 100);
+        seen++;
+      }
+      for ([[maybe_unused]] auto [e, v] : view<position>(viewer)) {
+        seen++;
+      }
+      assert(seen == 1 + size_t(ENTITY_COUNT));
+      assert(viewer.pool_of<position>().back.shares_with(
+          w.pool_of<position>().back));
+      assert(viewer.pool_of<position>().forward.shares_with(
+          w.pool_of<position>().forward));
+    }
+
+    child.remove_entity(20);
+    entity born = child.add_entity();
+    child.add_component<position>(born, position{-1.0f, -1.0f});
+    assert(w.has_component<position>(20) && !w.has_component<position>(born));
+    assert(!child.has_component<position>(20));
+    assert(child.get_component<v3>(100).x == 100.0f);
+
+    // The parent keeps working after its fork is gone.
+    { auto scratch = w.fork(); }
+    w.get_component<position>(30).x = 3.0f;
+    [[maybe_unused]] entity next = w.add_entity();
+    assert(next == born);
+  }
+
+  // ---------------- ROLLBACK HISTORY ----------------
+  {
+    std::println("Testing rollback history");
+    using world_t = mm::ecs::ecs<v3, velocity, label>;
+    world_t w;
+    for (int i = 0; i < 10'000; i++) {
+      entity e = w.add_entity();
+      w.add_component<v3>(e, v3{float(i), 0.0f, 0.0f});
+      if (i % 2 == 0) {
+        w.add_component<velocity>(e, velocity{1.0f, 0.0f, 0.0f});
+      }
+    }
+
+    auto same = [](world_t &a, world_t &b) {
+      const auto &pa = a.pool_of<v3>(), &pb = b.pool_of<v3>();
+      if (pa.back != pb.back || pa.forward != pb.forward ||
+          pa.refcounts != pb.refcounts) {
+        return false;
+      }
+      for (size_t i = 0; i < pa.data.size(); i++) {
+        if (pa.data[i].x != pb.data[i].x || pa.data[i].y != pb.data[i].y) {
+          return false;
+        }
+      }
+      const auto &la = a.pool_of<label>(), &lb = b.pool_of<label>();
+      for (size_t i = 0; i < la.data.size(); i++) {
+        if (la.data[i].text != lb.data[i].text) {
+          return false;
+        }
+      }
+      return la.back == lb.back && a.pool_of<velocity>().back ==
+                                       b.pool_of<velocity>().back;
+    };
+
+    spatial_grid<v3> grid(w, 8.0f);
+    world_history history(w, 8);
+    std::vector<world_t> checkpoints;
+    checkpoints.push_back(w.fork());
+    std::mt19937 rng(7);
+    for (int frame = 0; frame < 12; frame++) {
+      for (int k = 0; k < 200; k++) {
+        entity e = entity(rng() % 10'000);
+        switch (rng() % 5) {
+        case 0:
+          if (w.has_component<v3>(e)) {
+            w.get_component<v3>(e).y += 1.0f;
+          }
+          break;
+        case 1:
+          if (w.has_component<v3>(e)) {
+            w.remove_component<v3>(e);
+          }
+          break;
+        case 2:
+          if (!w.has_component<label>(e)) {
+            w.add_component<label>(e, label{std::to_string(frame)});
+          }
+          break;
+        case 3: {
+          entity fresh = w.add_entity();
+          w.add_component<v3>(fresh, v3{-1.0f, 0.0f, 0.0f});
+          w.remove_entity(e);
+          break;
+        }
+        default:
+          if (w.has_component<v3>(e)) {
+            w.patch_component<v3>(e, [](v3 &p) { p.x *= 2.0f; });
+          }
+        }
+      }
+      if (frame % 4 == 0) {
+        for (auto [e, c] : view<velocity>(w)) {
+          std::get<0>(c).x += 1.0f;
+        }
+      }
+      history.mark();
+      checkpoints.push_back(w.fork());
+    }
+    assert(history.checkpoints() == 8);
+
+    // Uncommitted changes go first, then whole frames.
+    w.get_component<v3>(w.pool_of<v3>().back[0]).x = 1e9f;
+    history.rewind();
+    assert(same(w, checkpoints.back()));
+    history.rewind(4);
+    checkpoints.resize(checkpoints.size() - 3);
+    assert(same(w, checkpoints.back()));
+    assert(history.checkpoints() == 5);
+    [[maybe_unused]] entity next = w.add_entity();
+    [[maybe_unused]] entity expected = checkpoints.back().add_entity();
+    assert(next == expected);
+    history.rewind(5);
+    assert(same(w, checkpoints[checkpoints.size() - 5]));
+
+    // The grid followed every rewound addition, removal and write.
+    assert(grid.size() == w.pool_of<v3>().back.size());
+    [[maybe_unused]] size_t near = 0;
+    for (auto [e, v] : view<v3>(w)) {
+      auto &[p] = v;
+      near += p.x * p.x + p.y * p.y + p.z * p.z <= 100.0f * 100.0f;
+    }
+    assert(grid.query_radius({0.0f, 0.0f, 0.0f}, 100.0f).size() == near);
+
+    // Undoing an addition on a fresh, high id shrinks forward back to its
+    // old size, whichever add path grew it. Views log only the elements they
+    // hand out mutably.
+    {
+      mm::ecs::ecs<v3> small;
+      for (int i = 0; i < 5001; i++) {
+        entity e = small.add_entity();
+        if (i < 10) {
+          small.add_component<v3>(e, v3{float(i), 0.0f, 0.0f});
+        }
+      }
+      world_history h(small, 2);
+      const auto &pool = small.pool_of<v3>();
+      const auto forward = pool.forward;
+      const auto back = pool.back;
+      [[maybe_unused]] auto added =
+          small.add_component<v3, safety_policy::checked>(5000, v3{});
+      assert(added && pool.forward.size() == 5001);
+      small.add_component<v3>(4000, v3{});
+      [[maybe_unused]] float read = 0.0f;
+      for (auto [e, v] : view<const v3>(small)) {
+        read += std::get<0>(v).x;
+      }
+      for (auto [e, v] : view<v3>(small)) {
+        std::get<0>(v).y = 1.0f;
+        if (e == 3) {
+          break;
+        }
+      }
+      assert(!pool.undo->ring.open().copied);
+      assert(pool.undo->ring.open().entries.size() == 2 + 4);
+      h.rewind();
+      assert(pool.forward == forward && pool.back == back);
+      assert(pool.data.size() == 10 && pool.refcounts.size() == 10);
+      for (size_t i = 0; i < pool.data.size(); i++) {
+        assert(pool.data[i].x == float(i) && pool.data[i].y == 0.0f);
+      }
+    }
+
+    // Rewinding notifies component listeners as for the inverse operations,
+    // but not entity listeners.
+    {
+      mm::ecs::ecs<v3> small;
+      entity kept = small.add_entity();
+      small.add_component<v3>(kept, v3{});
+      world_history h(small);
+      small.remove_component<v3>(kept);
+      entity fresh = small.add_entity();
+      small.add_component<v3>(fresh, v3{});
+      [[maybe_unused]] size_t constructed = 0, destroyed = 0, entity_events = 0;
+      small.on_construct<v3>().connect([&](entity, v3 &) { constructed++; });
+      small.on_destroy<v3>().connect([&](entity, v3 &) { destroyed++; });
+      small.on_entity_create().connect([&](entity) { entity_events++; });
+      small.on_entity_destroy().connect([&](entity) { entity_events++; });
+      h.rewind();
+      assert(constructed == 1 && destroyed == 1 && entity_events == 0);
+      assert(small.has_component<v3>(kept) && !small.has_component<v3>(fresh));
+    }
+
+    // Ids that were never registered are not reported as destroyed.
+    size_t destroyed = 0;
+    auto counting =
+        w.on_entity_destroy().connect([&](entity) { destroyed++; });
+    const entity doomed[] = {w.add_entity(), 1'000'000};
+    w.remove_entities(doomed);
+    w.on_entity_destroy().disconnect(counting);
+    assert(destroyed == 1);
+  }
+
+  // ---------------- MAPPED POOLS ----------------
+  {
+    std::println("Testing mapped pools");
+    const std::string path = "/tmp/mm_ecs_test_health";
+    for (const char *ext : {".data", ".back", ".forward"}) {
+      std::remove((path + ext).c_str());
+    }
+
+    {
+      mm::ecs::ecs<v3, health> w;
+      for (int i = 0; i < 1000; i++) {
+        entity e = w.add_entity();
+        w.add_component<health>(e, health{i});
+      }
+      [[maybe_unused]] auto created = w.map_pool<health>(path);
+      assert(created.value() == false);
+      // Growth past the first mapping extends the files.
+      for (int i = 1000; i < 100'000; i++) {
+        entity e = w.add_entity();
+        w.add_component<health>(e, health{i});
+        w.add_component<v3>(e, v3{});
+      }
+      for (entity e = 0; e < 100'000; e += 10) {
+        w.remove_component<health>(e);
+      }
+      // Multi-component views walk a mapped pool like any other.
+      [[maybe_unused]] size_t both = 0;
+      for ([[maybe_unused]] auto [e, v] : view<health, v3>(w)) {
+        [[maybe_unused]] auto &[h, p] = v;
+        assert(h.hp == int(e));
+        both++;
+      }
+      assert(both == 89'100);
+      w.sync_pools();
+    }
+
+    {
+      mm::ecs::ecs<v3, health> w;
+      size_t constructed = 0;
+      [[maybe_unused]] auto counter = w.on_construct<health>().connect(
+          [&](entity, health &) { constructed++; });
+      [[maybe_unused]] auto adopted = w.map_pool<health>(path);
+      assert(adopted.value() == true && constructed == 90'000);
+      assert(w.pool_of<health>().data.size() == 90'000);
+      for (entity e = 0; e < 100'000; e++) {
+        assert(w.has_component<health>(e) == (e % 10 != 0));
+        if (e % 10 != 0) {
+          assert(w.get_component<health>(e).hp == int(e));
+        }
+      }
+      [[maybe_unused]] entity next = w.add_entity();
+      assert(next == 100'000);
+      w.remove_entity(1);
+      assert(!w.has_component<health>(1));
+    }
+
+    {
+      mm::ecs::ecs<health> w;
+      entity e = w.add_entity();
+      w.add_component<health>(e, health{1});
+      // Copies of an element survive the arrays moving as they grow.
+      for (int i = 0; i < 5000; i++) {
+        w.add_component<health>(w.add_entity(), w.get_component<health>(e));
+      }
+      for ([[maybe_unused]] auto [other, v] : view<health>(w)) {
+        [[maybe_unused]] auto &[h] = v;
+        assert(h.hp == 1);
+      }
+      [[maybe_unused]] auto taken = w.map_pool<health>(path);
+      assert(taken.error() == error::component_already_exists);
+    }
+
+    // A forward file that disagrees with the dense arrays is rejected: entity
+    // 1 (removed above) is pointed at a slot after the 64-byte header.
+    {
+      std::fstream forward(path + ".forward",
+                           std::ios::in | std::ios::out | std::ios::binary);
+      forward.seekp(std::streamoff(64 + sizeof(size_t)));
+      const size_t bad = 3;
+      forward.write(reinterpret_cast<const char *>(&bad), sizeof bad);
+    }
+    {
+      mm::ecs::ecs<health> w;
+      [[maybe_unused]] auto corrupt = w.map_pool<health>(path);
+      assert(corrupt.error() == error::snapshot_incompatible);
+    }
+
+    for (const char *ext : {".data", ".back", ".forward"}) {
+      std::remove((path + ext).c_str());
+    }
+  }
+
+  // ---------------- SHARED MEMORY WORLD ----------------
+  {
+    std::println("Testing shared memory world");
+    const std::string name = "/mm_ecs_test_" + std::to_string(::getpid());
+    mm::ecs::ecs<health> w;
+    for (int i = 0; i < 1000; i++) {
+      w.add_component<health>(w.add_entity(), health{0});
+    }
+    auto writer = mm::ecs::shm_writer<health>::create(w, name);
+    assert(writer.has_value());
+    auto reader = mm::ecs::shm_reader<health>::open(name);
+    assert(reader.has_value());
+    [[maybe_unused]] auto mismatched =
+        mm::ecs::shm_reader<v3, health>::open(name);
+    assert(!mismatched.has_value());
+
+    // A second writer cannot take the name, and its failed create leaves the
+    // other world's listeners alone.
+    {
+      mm::ecs::ecs<health> other;
+      size_t created = 0;
+      auto listening =
+          other.on_entity_create().connect([&](entity) { created++; });
+      [[maybe_unused]] auto taken =
+          mm::ecs::shm_writer<health>::create(other, name);
+      assert(taken.error() == error::mapping_failed);
+      [[maybe_unused]] entity e = other.add_entity();
+      assert(created == 1);
+      other.on_entity_create().disconnect(listening);
+    }
+
+    constexpr int frames = 2000;
+    std::atomic<bool> done = false;
+    size_t snapshots = 0;
+    std::thread observer([&] {
+      int last = 0;
+      while (!done.load()) {
+        // Every snapshot has one value for all entities and matches the
+        // published entity list, even while the writer grows the pool.
+        auto [frame, count, entities] = reader->read([](auto &r) {
+          const auto hp = r.template components<health>();
+          const int first = hp.empty() ? 0 : hp.front().hp;
+          const bool uniform = std::ranges::all_of(
+              hp, [&](const health &h) { return h.hp == first; });
+          return std::tuple(uniform ? first : -1, hp.size(),
+                            r.entities().size());
+        });
+        assert(frame >= last && count == entities);
+        assert(count == 1000 + size_t(frame));
+        last = frame;
+        ++snapshots;
+      }
+    });
+
+    duration<double> writing{};
+    for (int frame = 1; frame <= frames; frame++) {
+      auto start = steady_clock::now();
+      {
+        auto guard = writer->write();
+        for (health &h : w.pool_of<health>().data) {
+          h.hp = frame;
+        }
+        w.add_component<health>(w.add_entity(), health{frame});
+      }
+      writing += steady_clock::now() - start;
+      // Leave readers a window between frames, as a game loop would.
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+    done = true;
+    observer.join();
+
+    reader->read([&](auto &r) {
+      assert(r.entities().size() == 1000 + frames);
+      assert(r.template get<health>(1500)->hp == frames);
+      assert(!r.template get<health>(1000 + frames).has_value());
+      assert(r.entity_counter() == 1000 + frames);
+      return 0;
+    });
+    std::println("{} frames published, {} consistent reads, {:.2f} us/frame",
+                 frames, snapshots,
+                 writing.count() * 1e6 / frames);
+  }
+
+  // ---------------- COLUMNAR EXPORT ----------------
+  {
+    std::println("Testing columnar export");
+    mm::ecs::ecs<v3, test_data> w;
+    constexpr int n = 1'000'000;
+    std::vector<entity> es(n);
+    for (int i = 0; i < n; i++) {
+      es[i] = w.add_entity();
+      w.add_component<v3>(es[i], v3{float(i), float(2 * i), float(3 * i)});
+      if (i % 100 == 0) {
+        w.add_component<test_data>(es[i], test_data{i});
+      }
+    }
+    for (int i = 0; i < n; i += 7) {
+      w.remove_component<v3>(es[i]);
+    }
+
+    std::stringstream columns;
+    auto start = steady_clock::now();
+    w.export_columns<v3>(columns);
+    const duration<double, std::milli> export_time =
+        steady_clock::now() - start;
+    const std::string bytes = columns.str();
+
+    // One entity column and one column per field, each 64-byte aligned.
+    auto header = [&](size_t at, auto v) {
+      std::memcpy(&v, bytes.data() + at, sizeof(v));
+      return v;
+    };
+    const uint64_t rows = header(16, uint64_t{});
+    assert(rows == w.pool_of<v3>().data.size());
+    assert(header(8, uint32_t{}) == 4);
+    for (size_t c = 0; c < 4; c++) {
+      const size_t desc = 32 + c * 24;
+      assert(header(desc, uint8_t{}) == (c == 0 ? 'u' : 'f'));
+      assert(header(desc + 8, uint64_t{}) % 64 == 0);
+    }
+    const uint64_t ys = header(32 + 2 * 24 + 8, uint64_t{});
+    for (size_t i = 0; i < rows; i += 1000) {
+      const entity e = header(header(32 + 8, uint64_t{}) + i * 4, entity{});
+      assert(header(ys + i * 4, float{}) == float(2 * e));
+    }
+
+    mm::ecs::ecs<v3, test_data> copy;
+    entity existing = copy.add_entity();
+    copy.add_component<v3>(existing, v3{});
+    // Listeners see the old contents go and every imported row arrive, on
+    // entities that are already registered.
+    [[maybe_unused]] size_t registered = 0, constructed = 0, destroyed = 0;
+    auto on_register =
+        copy.on_entity_create().connect([&](entity) { registered++; });
+    auto on_import = copy.on_construct<v3>().connect(
+        [&](entity, v3 &) { constructed += registered == rows; });
+    auto on_drop =
+        copy.on_destroy<v3>().connect([&](entity, v3 &) { destroyed++; });
+    start = steady_clock::now();
+    [[maybe_unused]] auto imported = copy.import_columns<v3>(columns);
+    const duration<double, std::milli> import_time =
+        steady_clock::now() - start;
+    assert(imported);
+    assert(constructed == rows && destroyed == 1);
+    copy.on_entity_create().disconnect(on_register);
+    copy.on_construct<v3>().disconnect(on_import);
+    copy.on_destroy<v3>().disconnect(on_drop);
+    for (int i = 0; i < n; i++) {
+      assert(copy.has_component<v3>(es[i]) == (i % 7 != 0));
+      if (i % 7 != 0) {
+        assert(copy.get_component<v3>(es[i]).z == float(3 * i));
+      }
+    }
+    [[maybe_unused]] entity next = copy.add_entity();
+    assert(next == es[n - 2] + 1);
+
+    std::stringstream blobs;
+    w.export_columns<test_data>(blobs);
+    [[maybe_unused]] auto blobs_in = copy.import_columns<test_data>(blobs);
+    assert(blobs_in);
+    assert(copy.get_component<test_data>(es[500])[0] == 500);
+
+    std::stringstream wrong(bytes);
+    [[maybe_unused]] auto mismatched = copy.import_columns<test_data>(wrong);
+    assert(mismatched.error() == error::snapshot_incompatible);
+    std::stringstream cut(bytes.substr(0, bytes.size() / 2));
+    [[maybe_unused]] auto truncated = copy.import_columns<v3>(cut);
+    assert(truncated.error() == error::snapshot_io_failed);
+
+    // A row count the stream cannot back fails on the short read: the
+    // columns are re-described for 2^36 rows over the same bytes.
+    std::string inflated = bytes;
+    const uint64_t huge = uint64_t(1) << 36;
+    std::memcpy(inflated.data() + 16, &huge, sizeof(huge));
+    for (uint64_t c = 0, offset = 128; c < 4; c++, offset += 4 * huge) {
+      const uint64_t desc[] = {offset, 4 * huge};
+      std::memcpy(inflated.data() + 32 + c * 24 + 8, desc, sizeof(desc));
+    }
+    std::stringstream inflated_in(inflated);
+    [[maybe_unused]] auto oversized = copy.import_columns<v3>(inflated_in);
+    assert(oversized.error() == error::snapshot_io_failed);
+
+    // Bool and array fields are copied bytewise.
+    mm::ecs::ecs<flags, sample> mixed, mixed_copy;
+    for (int i = 0; i < 5000; i++) {
+      entity e = mixed.add_entity();
+      mixed.add_component<flags>(e, flags{i % 3 == 0, i});
+      mixed.add_component<sample>(e, sample{{float(i), 1.0f, 2.0f}, -i});
+    }
+    std::stringstream flag_columns, sample_columns;
+    mixed.export_columns<flags>(flag_columns);
+    mixed.export_columns<sample>(sample_columns);
+    [[maybe_unused]] auto flags_in =
+        mixed_copy.import_columns<flags>(flag_columns);
+    [[maybe_unused]] auto samples_in =
+        mixed_copy.import_columns<sample>(sample_columns);
+    assert(flags_in && samples_in);
+    for (entity e = 0; e < 5000; e++) {
+      assert(mixed_copy.get_component<flags>(e).on == (e % 3 == 0));
+      assert(mixed_copy.get_component<flags>(e).level == int(e));
+      [[maybe_unused]] const sample &s = mixed_copy.get_component<sample>(e);
+      assert(s.v[0] == float(e) && s.v[2] == 2.0f && s.k == -int(e));
+    }
+
+    // A bool column byte other than 0 or 1 is rejected.
+    std::string flag_bytes = flag_columns.str();
+    uint64_t bools = 0;
+    std::memcpy(&bools, flag_bytes.data() + 32 + 24 + 8, sizeof(bools));
+    flag_bytes[bools + 1] = 2;
+    std::stringstream bad_flags(flag_bytes);
+    mm::ecs::ecs<flags, sample> strict;
+    [[maybe_unused]] auto rejected = strict.import_columns<flags>(bad_flags);
+    assert(rejected.error() == error::snapshot_incompatible);
+    std::println("Exported {} rows in {:.1f} ms, imported in {:.1f} ms", rows,
+                 export_time.count(), import_time.count());
+  }
+
+  // ---------------- WORKLOAD TRACES ----------------
+  {
+    std::println("Testing workload capture and replay");
+    std::stringstream trace;
+    ostream_sink sink{trace};
+    uint64_t records = 0;
+    using traced_views = trace_views<view<v3, test_data>, view<v3>>;
+    mm::ecs::ecs<v3, test_data> w;
+    entity before = w.add_entity();
+    w.add_component<v3>(before, v3{});
+    {
+      trace_recorder rec(w, sink, traced_views{});
+      std::vector<entity> es;
+      for (int i = 0; i < 20'000; i++) {
+        es.push_back(rec.add_entity());
+        rec.add_component<v3>(es.back(), v3{1, 2, 3});
+        if (i % 2 == 0) {
+          rec.add_component<test_data>(es.back());
+        }
+      }
+      for (int frame = 0; frame < 3; frame++) {
+        for (auto [e, v] : rec.view<v3, test_data>()) {
+          std::get<0>(v).x += 1;
+        }
+        for (int i = frame; i < 20'000; i += 10) {
+          rec.remove_component<v3>(es[i]);
+        }
+      }
+      for (int i = 0; i < 1000; i++) {
+        rec.remove_entity(es[i]);
+      }
+      rec.remove_component<v3>(before);
+      for ([[maybe_unused]] auto [e, v] : rec.view<v3>()) {
+      }
+      [[maybe_unused]] auto flushed = rec.flush();
+      assert(flushed);
+      records = rec.records();
+      assert(records == 20'000 + 20'000 + 10'000 + 3 + 6000 + 1000 + 1 + 1);
+    }
+    const std::string bytes = trace.str();
+    std::println("Recorded {} records in {} bytes", records, bytes.size());
+
+    // Replayed ids shift by one: the recording world created `before` first,
+    // which the replay creates on its first use.
+    mm::ecs::ecs<v3, test_data> replayed;
+    std::stringstream in(bytes);
+    istream_source source{in};
+    auto report = replay_trace(replayed, source, traced_views{});
+    assert(report.has_value());
+    assert((*report)[trace_op::create].count == 20'000);
+    assert((*report)[trace_op::add].count == 30'000);
+    assert((*report)[trace_op::remove].count == 6001);
+    assert((*report)[trace_op::destroy].count == 1000);
+    assert((*report)[trace_op::view].count == 4);
+    assert(report->view_entities ==
+           10'000 + 8000 + 8000 + replayed.pool_of<v3>().data.size());
+    assert(replayed.pool_of<v3>().data.size() ==
+           w.pool_of<v3>().data.size());
+    assert(replayed.pool_of<test_data>().data.size() ==
+           w.pool_of<test_data>().data.size());
+    std::println("Replayed in {:.2f} ms: views {:.2f} ms, adds {:.2f} ms",
+                 report->total_ns() / 1e6,
+                 (*report)[trace_op::view].ns / 1e6,
+                 (*report)[trace_op::add].ns / 1e6);
+
+    std::stringstream cut(bytes.substr(0, bytes.size() - 1));
+    istream_source cut_source{cut};
+    [[maybe_unused]] auto cut_report =
+        replay_trace(replayed, cut_source, traced_views{});
+    assert(cut_report.error() == error::stream_io_failed);
+    std::stringstream other(bytes);
+    istream_source other_source{other};
+    mm::ecs::ecs<v3> wrong;
+    [[maybe_unused]] auto wrong_report =
+        replay_trace(wrong, other_source, trace_views<view<v3>>{});
+    assert(wrong_report.error() == error::snapshot_incompatible);
+    // The same world with a different view list is refused as well.
+    std::stringstream relisted(bytes);
+    istream_source relisted_source{relisted};
+    using relisted_views = trace_views<view<v3>, view<v3, test_data>>;
+    [[maybe_unused]] auto relisted_report =
+        replay_trace(replayed, relisted_source, relisted_views{});
+    assert(relisted_report.error() == error::snapshot_incompatible);
+
+    // Views over mapped and copy-on-write pools record and replay too.
+    std::stringstream stored;
+    ostream_sink stored_sink{stored};
+    using stored_views =
+        trace_views<view<health, position>, view<const position>>;
+    mm::ecs::ecs<health, position> source_world, target_world;
+    {
+      trace_recorder rec(source_world, stored_sink, stored_views{});
+      for (int i = 0; i < 1000; i++) {
+        entity e = rec.add_entity();
+        rec.add_component<position>(e, position{float(i), 0.0f});
+        if (i % 3 == 0) {
+          rec.add_component<health>(e, health{i});
+        }
+      }
+      for (auto [e, v] : rec.view<health, position>()) {
+        std::get<0>(v).hp++;
+      }
+      for ([[maybe_unused]] auto [e, v] : rec.view<const position>()) {
+      }
+    }
+    std::stringstream stored_in(stored.str());
+    istream_source stored_source{stored_in};
+    [[maybe_unused]] auto stored_report =
+        replay_trace(target_world, stored_source, stored_views{});
+    assert(stored_report && stored_report->view_entities == 334 + 1000);
+    assert(target_world.pool_of<health>().data.size() == 334);
+  }
+
+  // ---------------- POOL STATISTICS ----------------
+  {
+    std::println("Testing pool statistics");
+    mm::ecs::ecs<v3, test_data> w;
+    std::vector<entity> es;
+    for (int i = 0; i < 1000; i++) {
+      es.push_back(w.add_entity());
+      w.add_component<v3>(es.back());
+    }
+    for (int i = 500; i < 1000; i++) {
+      w.remove_component<v3>(es[i]);
+    }
+    w.add_component<test_data>(es[10]);
+
+    smart_ref<v3> a = w.get_component<v3, reference_style::stable>(es[1]);
+    smart_ref<v3> b = a;
+    smart_ref<v3> c = w.get_component<v3, reference_style::stable>(es[2]);
+
+    auto st = w.stats();
+    const pool_stats &p = st.pools[0];
+    assert(st.entities == 1000 && st.next_entity == 1000);
+    assert(p.size == 500 && p.forward_size == 1000);
+    assert(p.forward_density == 0.5);
+    assert(p.added == 1000 && p.removed == 500 && p.refs == 3);
+    [[maybe_unused]] const ref_stats refs = w.scan_refs<v3>();
+    assert(refs.total_refs == 3 && refs.max_refs == 2 && refs.pinned == 2);
+    b.release();
+    assert(w.stats<v3>().refs == 2 && w.scan_refs<v3>().total_refs == 2);
+    assert(p.data_capacity >= 500 && p.data_bytes >= 500 * sizeof(v3));
+    assert(p.bytes() >= p.data_bytes + p.back_bytes + p.forward_bytes);
+    assert(st.pools[1].size == 1 && st.pools[1].forward_size == 11);
+    assert(st.bytes() == st.entity_bytes + p.bytes() + st.pools[1].bytes());
+
+    w.reset_stats();
+    w.add_component<v3>(es[700]);
+    assert(w.stats<v3>().added == 1 && w.stats<v3>().removed == 0);
+    assert(w.scan_refs<test_data>().total_refs == 0);
+
+    // Bulk paths count too: loading a snapshot drops the 3 current
+    // components and adds the 500 saved ones.
+    mm::ecs::ecs<v3, test_data> saved, target;
+    for (int i = 0; i < 500; i++) {
+      saved.add_component<v3>(saved.add_entity());
+    }
+    for (int i = 0; i < 3; i++) {
+      target.add_component<v3>(target.add_entity());
+    }
+    std::stringstream image;
+    [[maybe_unused]] auto written = saved.save(image);
+    [[maybe_unused]] auto loaded = target.load(image);
+    assert(written && loaded);
+    assert(target.stats<v3>().added == 503);
+    assert(target.stats<v3>().removed == 3);
+
+    // Stats do not depend on the pool size.
+    mm::ecs::ecs<v3> large;
+    for (int i = 0; i < 1'000'000; i++) {
+      large.add_component<v3>(large.add_entity());
+    }
+    constexpr int frames = 10'000;
+    auto start = steady_clock::now();
+    size_t bytes = 0;
+    for (int i = 0; i < frames; i++) {
+      bytes += large.stats<v3>().bytes();
+    }
+    auto end = steady_clock::now();
+    std::println("Stats of a {} component pool in {:.1f} ns ({} bytes); "
+                 "world {} bytes",
+                 large.stats<v3>().size,
+                 duration<double, std::nano>(end - start).count() / frames,
+                 bytes / frames, st.bytes());
+  }
+
   // ---------------- TOTAL ----------------
   auto end_total = steady_clock::now();
   std::println("Total runtime: {:.3f} s",